@@ -0,0 +1,227 @@
+// Copyright 2013 Michael Lopez
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+//  Batch congruence solver
+//
+//  Solves many small, independent congruence problems on a pool of threads.
+//  Each worker owns a single congruence closure that is cleared and reused
+//  between problems, so the per-problem setup is paid once per worker. Idle
+//  workers steal problems from busy ones, and the results are handed back in
+//  the order of the inputs as soon as they are available.
+
+
+
+#ifndef DIMITRI_BATCH_HPP
+#define DIMITRI_BATCH_HPP
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <exception>
+#include "congruence.hpp"
+
+
+
+namespace dimitri {
+
+  // ---------------------------- //
+  // --- Work stealing queues --- //
+  // ---------------------------- //
+  // One queue of problem indices per worker. A worker takes problems from the
+  // front of its own queue and steals from the back of the others. No problems
+  // are added once the workers start, so a worker whose queue is empty and who
+  // fails to steal is done.
+
+  struct work_queues_t {
+    using size_t = std::size_t;
+
+    work_queues_t (size_t, size_t);
+
+    bool pop (size_t, size_t&);
+    bool steal (size_t, size_t&);
+
+    struct queue_t {
+      std::mutex lock;
+      std::deque<size_t> work;
+    };
+    std::vector<queue_t> queues;
+  };
+
+
+
+  // -------------------- //
+  // --- Batch solver --- //
+  // -------------------- //
+  // Runs solve(closure, input) for each input, where closure is the calling
+  // worker's Congruence, freshly cleared. emit(index, result) is called once
+  // per input, in input order, by one worker at a time; the other workers
+  // keep solving while it runs. The result type must be default
+  // constructible. If solve or emit throws, the remaining problems are
+  // abandoned and the exception is rethrown.
+
+  template <typename Congruence>
+    struct batch_solver_t {
+      using size_t = std::size_t;
+
+      batch_solver_t (
+        size_t = std::thread::hardware_concurrency(),
+        const Congruence& = Congruence());
+
+      template <typename Input, typename Solve, typename Emit>
+        void solve (const std::vector<Input>&, Solve, Emit);
+
+      // -- Per worker closures, reused across calls to solve
+      std::vector<Congruence> closures;
+    };
+
+
+
+//// ----------------------------------------------------------------------- ////
+//// ----- implementation details ------------------------------------------ ////
+//// ----------------------------------------------------------------------- ////
+
+  // ---------------------------- //
+  // --- Work stealing queues --- //
+  // ---------------------------- //
+
+  // -- deal the problems [0,n) out to the workers in contiguous blocks
+  inline work_queues_t::work_queues_t (size_t workers, size_t n)
+    : queues(workers)
+  {
+    for (size_t w = 0; w < workers; ++w)
+      for (size_t i = w * n / workers; i < (w + 1) * n / workers; ++i)
+        queues[w].work.push_back(i);
+  }
+
+  inline bool work_queues_t::pop (size_t worker, size_t& i)
+  {
+    queue_t& q = queues[worker];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.work.empty())
+      return false;
+    i = q.work.front();
+    q.work.pop_front();
+    return true;
+  }
+
+  // -- try every other queue, starting with the next worker
+  inline bool work_queues_t::steal (size_t thief, size_t& i)
+  {
+    for (size_t k = 1; k < queues.size(); ++k) {
+      queue_t& q = queues[(thief + k) % queues.size()];
+      std::lock_guard<std::mutex> guard(q.lock);
+      if (q.work.empty())
+        continue;
+      i = q.work.back();
+      q.work.pop_back();
+      return true; }
+    return false;
+  }
+
+
+
+  // -------------------- //
+  // --- Batch solver --- //
+  // -------------------- //
+
+  template <typename Congruence>
+    batch_solver_t<Congruence>::batch_solver_t (
+      size_t workers, const Congruence& prototype)
+      : closures(workers ? workers : 1, prototype)
+    { }
+
+  template <typename Congruence>
+  template <typename Input, typename Solve, typename Emit>
+    void batch_solver_t<Congruence>::solve (
+      const std::vector<Input>& inputs, Solve solve, Emit emit)
+    {
+      using result_t = decltype(solve(closures[0],inputs[0]));
+
+      work_queues_t queues(closures.size(),inputs.size());
+      std::vector<result_t> results(inputs.size());
+      std::vector<char> done(inputs.size(),false);
+      size_t next = 0;
+      bool emitting = false;
+      bool failed = false;
+      std::exception_ptr failure;
+      std::mutex lock;
+
+      // Stream out the completed prefix. At most one worker emits at a time,
+      // outside the lock, and keeps going until nothing more is ready, so
+      // the others only wait on the consumer when they have nothing to do.
+      auto stream = [&]() {
+        std::vector<result_t> ready;
+        for (;;) {
+          size_t first;
+          {
+            std::lock_guard<std::mutex> guard(lock);
+            ready.clear();
+            for (first = next; next < results.size() and done[next]; ++next)
+              ready.push_back(std::move(results[next]));
+            if (failed or ready.empty()) {
+              emitting = false;
+              return; }
+          }
+          for (size_t k = 0; k < ready.size(); ++k)
+            emit(first + k,ready[k]);
+        }
+      };
+
+      auto work = [&](size_t worker) {
+        Congruence& closure = closures[worker];
+        size_t i;
+        while (queues.pop(worker,i) or queues.steal(worker,i)) {
+          closure.clear();
+          try {
+            result_t r = solve(closure,inputs[i]);
+            {
+              std::lock_guard<std::mutex> guard(lock);
+              if (failed)
+                return;
+              results[i] = std::move(r);
+              done[i] = true;
+              if (emitting)
+                continue;
+              emitting = true;
+            }
+            stream();
+          }
+          catch (...) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!failed)
+              failure = std::current_exception();
+            failed = true;
+            return; }
+        }
+      };
+
+      std::vector<std::thread> threads;
+      for (size_t w = 1; w < closures.size(); ++w)
+        threads.push_back(std::thread(work,w));
+      work(0);
+      for (auto& t : threads)
+        t.join();
+      if (failure)
+        std::rethrow_exception(failure);
+    }
+
+
+
+}
+
+
+
+#endif // DIMITRI_BATCH_HPP
@@ -32,6 +32,11 @@
 
 #include <map>
 #include <vector>
+#include <memory>
+#include <thread>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 #include <algorithm>
 #include <utility>
 
@@ -55,11 +60,34 @@ namespace dimitri {
 
 
   struct non_template_t { int eggs () { return 0; } };
+  // ------------------------- //
+  // --- Symbol properties --- //
+  // ------------------------- //
+  // Properties of function symbols, as returned by the optional Symbol_flags
+  // operation of the expression algebra. The arguments of a commutative symbol
+  // are compared as a multiset. Nested applications of an associative symbol
+  // are flattened into a single application.
+
+  enum symbol_flag : unsigned {
+    commutative_symbol = 1,
+    associative_symbol = 2
+  };
+
+  // -- the default: every symbol is free
+  struct no_symbol_flags {
+    template <typename E>
+      unsigned operator() (const E&) const { return 0; }
+  };
+
+
+
   // ------------------ //
   // --- Union Find --- //
   // ------------------ //
   // The mighty union find data structure (or a simpler version of it). This
   // data structure maintains a partition of the integers [0,parent.size()).
+  // Each root also keeps a list of elements whose sets are known to be
+  // distinct from its own; union_sets refuses to merge two distinct sets.
 
   struct union_find_t {
     using size_t = std::size_t;
@@ -71,20 +99,211 @@ namespace dimitri {
 
     // -- Set algebra
     bool in_same_set (size_t, size_t);
-    void union_sets (size_t, size_t);
+    bool union_sets (size_t, size_t);
+    bool set_distinct (size_t, size_t);
+
+    // -- Visit the elements known to be distinct from the set of an element
+    template <typename F>
+      void for_each_distinct (size_t, F);
+    size_t count_distinct (size_t);
 
     // -- Get a fresh variable
     size_t fresh_variable ();
 
+    // -- Drop the elements that are not live and renumber the survivors
+    std::vector<size_t> compact (const std::vector<bool>&);
+
+    // -- Empty the universe, keeping the storage for reuse
+    void clear ();
+
+    // -- Presize for a universe of n elements, and report the bytes in use
+    void reserve (size_t);
+    size_t memory_usage () const;
+
     //  -- Parent mapping
     std::vector<size_t> parent;
 
+    //  -- Disequalities, indexed by root
+    std::vector<std::vector<size_t>> distinct;
+
     //  -- Get the roots of the elements in the universe
     size_t root_of (size_t);
   };
 
 
 
+  // ------------------------- //
+  // --- Persistent vector --- //
+  // ------------------------- //
+  // A vector with O(1) copies. The elements live in the leaves of a 32-way
+  // trie whose nodes are shared between copies. A write copies only the path
+  // from the root to the written leaf, so each copy pays for what it changes.
+
+  template <typename T>
+    struct persistent_vector_t {
+      using size_t = std::size_t;
+      using value_type = T;
+
+      struct node_t {
+        std::vector<std::shared_ptr<const node_t>> children;
+        std::vector<T> values;
+      };
+      using node_ptr = std::shared_ptr<const node_t>;
+
+      static const size_t bits = 5;
+      static const size_t width = size_t(1) << bits;
+
+      persistent_vector_t ();
+
+      size_t size () const { return count; }
+      const T& operator[] (size_t) const;
+      void set (size_t, const T&);
+      void push_back (const T&);
+
+      // -- Bytes reachable from this vector
+      size_t memory_usage () const;
+      static size_t memory_usage_in (const node_t*);
+
+      // -- Path copying
+      node_ptr set_in (const node_ptr&, size_t, size_t, const T&);
+      node_ptr push_in (const node_ptr&, size_t, size_t, const T&);
+
+      node_ptr root;
+      size_t count;
+      size_t shift;
+    };
+
+
+
+  // ----------------------------- //
+  // --- Persistent Union Find --- //
+  // ----------------------------- //
+  // A union find over persistent vectors. Copying it is O(1) and a copy only
+  // pays for the entries it changes, which makes it suitable for forking many
+  // branches off of a shared base. Paths are never compressed since that would
+  // write to shared storage; union by rank keeps them logarithmic instead.
+
+  struct persistent_union_find_t {
+    using size_t = std::size_t;
+
+    // -- Constructors
+    persistent_union_find_t ();
+
+    // -- Set algebra
+    bool in_same_set (size_t, size_t) const;
+    bool union_sets (size_t, size_t);
+    bool set_distinct (size_t, size_t);
+
+    // -- Visit the elements known to be distinct from the set of an element
+    template <typename F>
+      void for_each_distinct (size_t, F) const;
+    size_t count_distinct (size_t) const;
+
+    // -- Get a fresh variable
+    size_t fresh_variable ();
+
+    // -- Drop the elements that are not live and renumber the survivors
+    std::vector<size_t> compact (const std::vector<bool>&);
+
+    // -- Empty the universe
+    void clear ();
+
+    // -- Storage is allocated as it is written, so there is nothing to
+    // -- presize. The bytes in use include storage shared with copies.
+    void reserve (size_t) { }
+    size_t memory_usage () const;
+
+    //  -- Disequalities are kept in shared cons lists so that a merge only
+    //  -- conses the shorter list onto the longer one
+    struct distinct_link_t {
+      size_t var;
+      size_t length;
+      std::shared_ptr<const distinct_link_t> next;
+    };
+    using distinct_list_t = std::shared_ptr<const distinct_link_t>;
+
+    //  -- Parent mapping, the ranks of the roots and their disequalities
+    persistent_vector_t<size_t> parent;
+    persistent_vector_t<size_t> rank;
+    persistent_vector_t<distinct_list_t> distinct;
+
+    //  -- Get the roots of the elements in the universe
+    size_t root_of (size_t) const;
+  };
+
+
+
+  // ----------------- //
+  // --- Node pool --- //
+  // ----------------- //
+  // A free list of equally sized blocks, carved out of chunks that are only
+  // returned when the pool dies. Node based containers allocate one node at a
+  // time; with a pool they can be presized, and the nodes of erased elements
+  // are reused rather than freed. The block size is fixed by the first
+  // allocation, so a reservation made before then is deferred until it.
+
+  struct node_pool_t {
+    using size_t = std::size_t;
+
+    node_pool_t ();
+    node_pool_t (const node_pool_t&) = delete;
+    ~node_pool_t ();
+
+    bool fits (size_t);
+    void* allocate ();
+    void deallocate (void*);
+    void reserve (size_t);
+    void grow (size_t);
+    size_t memory_usage () const { return capacity * block_size; }
+
+    static size_t round (size_t);
+
+    size_t block_size;
+    size_t capacity;
+    size_t pending;
+    void* free_list;
+    std::vector<void*> chunks;
+  };
+
+  // -- An allocator drawing single nodes from a node_pool_t. Rebound copies
+  // -- share the pool, but copied containers get a pool of their own. Moving
+  // -- an allocator hands its pool over and leaves the source a fresh one, so
+  // -- that a moved-from container stays usable without sharing the pool,
+  // -- which is not thread-safe, with the container it was moved to.
+  template <typename T>
+    struct pool_allocator_t {
+      using size_t = std::size_t;
+      using value_type = T;
+      using propagate_on_container_move_assignment = std::true_type;
+      using propagate_on_container_swap = std::true_type;
+
+      pool_allocator_t ();
+      pool_allocator_t (const pool_allocator_t&) = default;
+      pool_allocator_t (pool_allocator_t&&);
+      template <typename U>
+        pool_allocator_t (const pool_allocator_t<U>&);
+      pool_allocator_t& operator= (const pool_allocator_t&) = default;
+      pool_allocator_t& operator= (pool_allocator_t&&);
+
+      T* allocate (size_t);
+      void deallocate (T*, size_t);
+      pool_allocator_t select_on_container_copy_construction () const;
+
+      std::shared_ptr<node_pool_t> pool;
+    };
+
+  template <typename T, typename U>
+    bool operator== (const pool_allocator_t<T>&, const pool_allocator_t<U>&);
+  template <typename T, typename U>
+    bool operator!= (const pool_allocator_t<T>&, const pool_allocator_t<U>&);
+
+  // -- An ordered map whose nodes come from a pool
+  template <typename K, typename V>
+    using pooled_map_t = std::map<K,V,std::less<K>,
+      pool_allocator_t<std::pair<const K,V>>>;
+
+
+
   // ------------------------------ //
   // --- Canonical element maps --- //
   // ------------------------------ //
@@ -104,9 +323,107 @@ namespace dimitri {
 
       maybe<size_t> get (expr_t);
       void set (expr_t, size_t);
+      void erase (expr_t);
+      void clear ();
+
+      // -- Visit every mapping, and renumber them after a compaction. The
+      // -- renumbered map gets a pool of its own size, so the nodes of erased
+      // -- expressions are returned.
+      template <typename F>
+        void for_each (F) const;
+      void renumber (const std::vector<size_t>&);
+
+      // -- Presize for n expressions, and report the bytes in use
+      void reserve (size_t);
+      size_t memory_usage () const;
+
+      // -- Representative elements
+      pooled_map_t<expr_t,size_t> representatives;
+    };
+
+
+
+  // ---------------------- //
+  // --- Persistent map --- //
+  // ---------------------- //
+  // An ordered map with O(1) copies, implemented as a treap whose nodes are
+  // shared between copies. An insertion copies the O(log n) nodes on the path
+  // to the new key and nothing else.
+
+  template <typename K, typename V>
+    struct persistent_map_t {
+      using size_t = std::size_t;
+
+      struct node_t {
+        node_t (const K&, const V&, std::uint64_t,
+          std::shared_ptr<const node_t>, std::shared_ptr<const node_t>);
+        K key;
+        V val;
+        std::uint64_t priority;
+        std::shared_ptr<const node_t> left;
+        std::shared_ptr<const node_t> right;
+      };
+      using node_ptr = std::shared_ptr<const node_t>;
+
+      persistent_map_t ();
+
+      size_t size () const { return count; }
+      maybe<V> get (const K&) const;
+      void insert (const K&, const V&);
+      void erase (const K&);
+
+      // -- Bytes reachable from this map
+      size_t memory_usage () const;
+
+      // -- In order traversal
+      template <typename F>
+        void for_each (F) const;
+      template <typename F>
+        static void for_each_in (const node_t*, F&);
+
+      // -- Path copying
+      node_ptr insert_in (const node_ptr&, const K&, const V&, std::uint64_t);
+      node_ptr erase_in (const node_ptr&, const K&);
+      static node_ptr merge (const node_ptr&, const node_ptr&);
+      std::uint64_t next_priority ();
+
+      node_ptr root;
+      size_t count;
+      std::uint64_t seed;
+    };
+
+
+
+  // ----------------------------------------- //
+  // --- Persistent canonical element maps --- //
+  // ----------------------------------------- //
+  // A canonical_map_t with O(1) copies.
+
+  template <typename E>
+    struct persistent_canonical_map_t
+    {
+      using expr_t = E;
+      using size_t = std::size_t;
+
+      persistent_canonical_map_t ();
+
+      maybe<size_t> get (expr_t);
+      void set (expr_t, size_t);
+      void erase (expr_t);
+      void clear ();
+
+      // -- Visit every mapping, and renumber them after a compaction
+      template <typename F>
+        void for_each (F) const;
+      void renumber (const std::vector<size_t>&);
+
+      // -- Nodes are allocated as they are written, so there is nothing to
+      // -- presize. The bytes in use include nodes shared with copies.
+      void reserve (size_t) { }
+      size_t memory_usage () const;
 
       // -- Representative elements
-      std::map<expr_t,size_t> representatives;
+      persistent_map_t<expr_t,size_t> representatives;
     };
 
 
@@ -115,17 +432,22 @@ namespace dimitri {
   // --- Expression Traversal --- //
   // ---------------------------- //
   // Ad-hoc expression traverser
+  // Applications of the same associative or commutative symbol are not
+  // compared argument by argument; they are reported whole unless identical.
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags = no_symbol_flags
   >
     struct expr_traversal {
       using expr_t = Expr;
       using expr_pair_t = std::pair<expr_t,expr_t>;
 
-      expr_traversal (const Args&, const Same_symbol&, const Num_args&);
+      expr_traversal (
+        const Args&, const Same_symbol&, const Num_args&,
+        const Symbol_flags& = Symbol_flags());
       std::vector<expr_pair_t> traverse (expr_t e1, expr_t e2);
 
       // The differences between the expressions
@@ -134,6 +456,7 @@ namespace dimitri {
       Args args;
       Same_symbol is_same_symbol;
       Num_args num_args;
+      Symbol_flags symbol_flags;
     };
 
 
@@ -148,12 +471,31 @@ namespace dimitri {
   // function that returns a random access iterator range, then Num args is not
   // necessary. However, as with GCC, this is not always the case. Hmm. I think
   // it can go. Must confer with brain.
+  //
+  // The auxiliary data structures are parameters so that the storage can be
+  // swapped out. See persistent_congruence_t below.
+  //
+  // The canonical element of an application is found through its canonical
+  // form: the symbol together with the canonical elements of its arguments.
+  // Two applications with the same canonical form are merged whenever a merge
+  // makes them coincide; each class keeps a list of the terms whose forms
+  // mention it, so a merge only revisits those. Terms whose symbols are
+  // associative or commutative (see symbol_flag) are not compared argument by
+  // argument, and their forms use the sorted canonical elements of the
+  // flattened arguments instead. An application that is not known to the
+  // closure is compared through its (flattened) arguments.
+  // Flattening only splices in the nested applications written in the term
+  // itself, not those merely known to be congruent to an argument: after
+  // x = a+b, the terms x+c and (a+b)+c are not found to be congruent.
 
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags = no_symbol_flags,
+    typename Reps = canonical_map_t<Expr>,
+    typename Sets = union_find_t
   >
     struct congruence_t {
 
@@ -163,32 +505,160 @@ namespace dimitri {
 
       congruence_t (
         const Args& = Args(), const Same_symbol& = Same_symbol(),
-        const Num_args& = Num_args());
+        const Num_args& = Num_args(), const Symbol_flags& = Symbol_flags());
       congruence_t (const congruence_t&);
       congruence_t (congruence_t&&);
 
       // Congruence Interface
+      // set_congruent and set_distinct return false as soon as an assertion
+      // contradicts an earlier one. The contradicting fact is not recorded.
       bool is_congruent (expr_t, expr_t);
       std::vector<expr_pair_t> report_differences (expr_t, expr_t);
-      void set_congruent (expr_t, expr_t);
+      bool set_congruent (expr_t, expr_t);
+      bool set_distinct (expr_t, expr_t);
+
+      // Bulk construction
+      // Asserts every equation, splitting the work across threads. Each thread
+      // finds the differences of a shard of the equations, partitions them
+      // locally and looks up the terms the closure already knows; the
+      // equations are then replayed into the closure in order, one thread
+      // generating their terms and merging their partitions. The result is
+      // the same as asserting the equations in order, canonical elements
+      // included: on a contradiction, the equations before it are kept and
+      // false is returned. The expression algebra must be safe to call from
+      // several threads at once.
+      bool set_congruent (
+        const std::vector<expr_pair_t>&,
+        size_t = std::thread::hardware_concurrency());
+
+      // Memory reclamation
+      // Released terms are forgotten by the closure, but the equalities and
+      // disequalities between the remaining terms are kept. A scope releases
+      // every term first seen since it was pushed; popping when no scope is
+      // open does nothing. The memory of released terms is reclaimed by
+      // compact, which renumbers the remaining terms and rebuilds the maps
+      // and the query cache on storage sized to what is left.
+      void release (expr_t);
+      void push_scope ();
+      void pop_scope ();
+      void compact ();
+
+      // Forget everything. By default the storage that can be reused by the
+      // next problem is kept; otherwise it is returned as compact does.
+      void clear (bool = true);
+
+      // Query caching
+      // When enabled, report_differences (and so is_congruent) remembers its
+      // answers. Merges only add equalities, so an answer without differences
+      // stays valid until terms are released; any other answer is only valid
+      // in the merge epoch it was computed in. Copies start with an empty
+      // cache so that forking a persistent closure stays cheap.
+      void enable_query_cache (bool = true);
+
+      // Memory planning
+      // reserve presizes the storage for the given number of terms and for the
+      // given number of equations, disequalities and queries, which bounds the
+      // size of the query cache. The disequality lists, the scopes and the
+      // canonical forms are not presized; they grow as needed. memory_usage
+      // reports the bytes held by each part of the closure, including
+      // reserved but unused storage.
+      struct memory_usage_t {
+        size_t sets;             // union find, disequalities and scopes
+        size_t reps;             // canonical element map
+        size_t cache;            // query cache
+        size_t canonical_forms;  // canonical forms of applications
+        size_t total () const { return sets + reps + cache + canonical_forms; }
+      };
+      void reserve (size_t, size_t);
+      memory_usage_t memory_usage () const;
 
       // Expression algebra
       Args args;
       Same_symbol is_same_symbol;
       Num_args num_args;
+      Symbol_flags symbol_flags;
 
       // Auxiliary data structures
-      canonical_map_t<expr_t> reps;
-      union_find_t sets;
+      Reps reps;
+      Sets sets;
+
+      // The terms first seen while a scope was open, and where the terms of
+      // each open scope start
+      std::vector<expr_t> scope_terms;
+      std::vector<size_t> scopes;
+
+      // Cached queries and the number of merges made so far
+      struct cached_query_t {
+        size_t epoch;
+        std::vector<expr_pair_t> diffs;
+      };
+      bool caching;
+      size_t epoch;
+      pooled_map_t<expr_pair_t,cached_query_t> cache;
+
+      // Canonical forms of the known applications: the canonical elements of
+      // their flattened arguments and their current forms, the terms with
+      // each form, and the terms whose forms mention each root. Copies share
+      // them until either one changes them, so that forking a persistent
+      // closure stays cheap.
+      using signature_t = std::vector<size_t>;
+      struct theory_term_t {
+        std::vector<size_t> flat_args;
+        signature_t sig;
+      };
+      struct canonical_forms_t {
+        std::map<expr_t,theory_term_t> terms;
+        std::map<signature_t,std::vector<expr_t>> signatures;
+        std::map<size_t,std::vector<expr_t>> uses;
+      };
+      std::shared_ptr<canonical_forms_t> forms;
 
       // Congruence algebra
       std::vector<expr_pair_t> differences (expr_t, expr_t);
       size_t get_or_gen_canonical (expr_t);
+      maybe<size_t> get_canonical (expr_t);
       bool not_directly_congruent (expr_pair_t);
+      bool merge (const std::vector<std::pair<size_t,size_t>>&);
+      void forget (expr_t, std::vector<size_t>&);
+
+      // Canonical forms
+      bool is_theory_term (expr_t);
+      bool has_canonical_form (expr_t);
+      std::vector<expr_t> flatten (expr_t);
+      template <typename Root>
+        signature_t signature (expr_t, const std::vector<size_t>&, Root);
+      maybe<size_t> find_signature (expr_t, const signature_t&);
+      bool same_canonical_form (expr_t, expr_t);
+      canonical_forms_t& writable_forms ();
+      void prune_uses (std::vector<size_t>&);
+      void reindex_forms ();
     };
 
 
 
+  // ------------------------------------- //
+  // --- Persistent congruence closure --- //
+  // ------------------------------------- //
+  // A congruence closure over persistent storage. Copying one forks the closure
+  // in O(1); the fork and the original then share everything they have in
+  // common and each only pays for the entries it adds or changes. The terms of
+  // open scopes are the exception: a fork copies them, so forking with a scope
+  // open costs time proportional to the terms first seen since the outermost
+  // open scope was pushed.
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags = no_symbol_flags
+  >
+    using persistent_congruence_t = congruence_t<
+      Expr, Args, Same_symbol, Num_args, Symbol_flags,
+      persistent_canonical_map_t<Expr>, persistent_union_find_t>;
+
+
+
 //// ----------------------------------------------------------------------- ////
 //// ----- implementation details ------------------------------------------ ////
 //// ----------------------------------------------------------------------- ////
@@ -218,44 +688,383 @@ namespace dimitri {
   // --- Union Find --- //
   // ------------------ //
 
-  union_find_t::union_find_t ()
-    : parent ()
+  inline union_find_t::union_find_t ()
+    : parent (), distinct ()
   { }
 
   // -- Set partition of [0,n) o be singletons
   // FIXME necessary?
-  union_find_t::union_find_t (size_t n)
-    : parent (n,0)
+  inline union_find_t::union_find_t (size_t n)
+    : parent (n,0), distinct (n)
   { for (size_t i = 0; i < n; ++i) parent[i] = i; }
 
-  union_find_t::union_find_t (const union_find_t& c)
-    : parent(c.parent)
+  inline union_find_t::union_find_t (const union_find_t& c)
+    : parent(c.parent), distinct(c.distinct)
   { }
 
   // -- true iff m and n are in the same set
-  bool union_find_t::in_same_set (size_t m, size_t n)
+  inline bool union_find_t::in_same_set (size_t m, size_t n)
   {
     return m == n or root_of(m) == root_of(n);
   }
 
-  // -- union the sets in the partition
+  // -- union the sets in the partition, unless they are distinct. Only the
+  // -- shorter disequality list is scanned and moved.
   // axiom: !in_same_set(m,n)
-  void union_find_t::union_sets (size_t m, size_t n)
+  inline bool union_find_t::union_sets (size_t m, size_t n)
   {
+    m = root_of(m);
     n = root_of(n);
+    std::vector<size_t>& shorter =
+      distinct[m].size() < distinct[n].size() ? distinct[m] : distinct[n];
+    size_t other = &shorter == &distinct[m] ? n : m;
+    for (size_t x : shorter)
+      if (root_of(x) == other)
+        return false;
     parent[n] = m;
+    if (distinct[m].size() < distinct[n].size())
+      distinct[m].swap(distinct[n]);
+    distinct[m].insert(distinct[m].end(),distinct[n].begin(),distinct[n].end());
+    std::vector<size_t>().swap(distinct[n]);
+    return true;
+  }
+
+  // -- record that the sets of m and n are distinct
+  inline bool union_find_t::set_distinct (size_t m, size_t n)
+  {
+    if (in_same_set(m,n))
+      return false;
+    distinct[root_of(m)].push_back(n);
+    distinct[root_of(n)].push_back(m);
+    return true;
+  }
+
+  template <typename F>
+    void union_find_t::for_each_distinct (size_t n, F f)
+    {
+      for (size_t x : distinct[root_of(n)])
+        f(x);
+    }
+
+  // -- return the number of elements visited by for_each_distinct
+  inline size_t union_find_t::count_distinct (size_t n)
+  {
+    return distinct[root_of(n)].size();
+  }
+
+  // -- return a fresh variable
+  inline size_t union_find_t::fresh_variable ()
+  {
+    size_t var = parent.size();
+    parent.push_back(var);
+    distinct.emplace_back();
+    return var;
+  }
+
+  // -- renumber the live elements into [0,k), preserving their order, and
+  // -- return the renumbering. Dead elements map to parent.size(). Each set
+  // -- is rooted at its first live element and every path is flattened.
+  inline std::vector<size_t> union_find_t::compact (const std::vector<bool>& live)
+  {
+    size_t dead = parent.size();
+    std::vector<size_t> renumbered(parent.size(),dead);
+    std::vector<size_t> new_root(parent.size(),dead);
+    size_t k = 0;
+    for (size_t i = 0; i < parent.size(); ++i)
+      if (live[i]) {
+        renumbered[i] = k++;
+        size_t r = root_of(i);
+        if (new_root[r] == dead)
+          new_root[r] = renumbered[i]; }
+
+    std::vector<size_t> new_parent(k);
+    std::vector<std::vector<size_t>> new_distinct(k);
+    for (size_t i = 0; i < parent.size(); ++i) {
+      if (live[i])
+        new_parent[renumbered[i]] = new_root[root_of(i)];
+      if (parent[i] != i or new_root[i] == dead)
+        continue;
+      std::vector<size_t>& d = new_distinct[new_root[i]];
+      for (size_t x : distinct[i])
+        if (new_root[root_of(x)] != dead)
+          d.push_back(new_root[root_of(x)]);
+      std::sort(d.begin(),d.end());
+      d.erase(std::unique(d.begin(),d.end()),d.end()); }
+
+    parent.swap(new_parent);
+    distinct.swap(new_distinct);
+    return renumbered;
+  }
+
+  // -- the vectors keep their capacity
+  inline void union_find_t::clear ()
+  {
+    parent.clear();
+    distinct.clear();
+  }
+
+  inline void union_find_t::reserve (size_t n)
+  {
+    parent.reserve(n);
+    distinct.reserve(n);
+  }
+
+  inline auto union_find_t::memory_usage () const -> size_t
+  {
+    size_t bytes = parent.capacity() * sizeof(size_t)
+      + distinct.capacity() * sizeof(std::vector<size_t>);
+    for (const auto& d : distinct)
+      bytes += d.capacity() * sizeof(size_t);
+    return bytes;
+  }
+
+  // -- get the canonical element of the set containing n, pointing each
+  // -- element on the way at its grandparent so that long chains of merges
+  // -- flatten out as they are walked
+  inline auto union_find_t::root_of (size_t n) -> size_t
+  {
+    size_t parent_of_n = parent[n];
+    while (n != parent_of_n) {
+      parent[n] = parent[parent_of_n];
+      n = parent_of_n;
+      parent_of_n = parent[n]; }
+    return n;
+  }
+
+
+
+  // ------------------------- //
+  // --- Persistent vector --- //
+  // ------------------------- //
+
+  template <typename T>
+    persistent_vector_t<T>::persistent_vector_t ()
+      : root(), count(0), shift(0)
+    { }
+
+  template <typename T>
+    auto persistent_vector_t<T>::operator[] (size_t i) const -> const T&
+    {
+      const node_t* n = root.get();
+      for (size_t s = shift; s > 0; s -= bits)
+        n = n->children[(i >> s) & (width - 1)].get();
+      return n->values[i & (width - 1)];
+    }
+
+  template <typename T>
+    void persistent_vector_t<T>::set (size_t i, const T& x)
+    {
+      root = set_in(root,shift,i,x);
+    }
+
+  // -- grow the trie by a level when the current levels are full
+  template <typename T>
+    void persistent_vector_t<T>::push_back (const T& x)
+    {
+      if (root and count == (size_t(1) << (shift + bits))) {
+        auto grown = std::make_shared<node_t>();
+        grown->children.push_back(root);
+        root = grown;
+        shift += bits; }
+      root = push_in(root,shift,count,x);
+      ++count;
+    }
+
+  template <typename T>
+    auto persistent_vector_t<T>::memory_usage () const -> size_t
+    {
+      return memory_usage_in(root.get());
+    }
+
+  template <typename T>
+    auto persistent_vector_t<T>::memory_usage_in (const node_t* n) -> size_t
+    {
+      if (!n)
+        return 0;
+      size_t bytes = sizeof(node_t) + n->children.capacity() * sizeof(node_ptr)
+        + n->values.capacity() * sizeof(T);
+      for (const auto& c : n->children)
+        bytes += memory_usage_in(c.get());
+      return bytes;
+    }
+
+  template <typename T>
+    auto persistent_vector_t<T>::set_in (
+      const node_ptr& n, size_t s, size_t i, const T& x) -> node_ptr
+    {
+      auto copy = std::make_shared<node_t>(*n);
+      if (s == 0)
+        copy->values[i & (width - 1)] = x;
+      else {
+        size_t k = (i >> s) & (width - 1);
+        copy->children[k] = set_in(copy->children[k],s - bits,i,x); }
+      return copy;
+    }
+
+  template <typename T>
+    auto persistent_vector_t<T>::push_in (
+      const node_ptr& n, size_t s, size_t i, const T& x) -> node_ptr
+    {
+      auto copy = n ? std::make_shared<node_t>(*n) : std::make_shared<node_t>();
+      if (s == 0)
+        copy->values.push_back(x);
+      else {
+        size_t k = (i >> s) & (width - 1);
+        if (k == copy->children.size())
+          copy->children.push_back(node_ptr());
+        copy->children[k] = push_in(copy->children[k],s - bits,i,x); }
+      return copy;
+    }
+
+
+
+  // ----------------------------- //
+  // --- Persistent Union Find --- //
+  // ----------------------------- //
+
+  inline persistent_union_find_t::persistent_union_find_t ()
+    : parent(), rank(), distinct()
+  { }
+
+  // -- true iff m and n are in the same set
+  inline bool persistent_union_find_t::in_same_set (size_t m, size_t n) const
+  {
+    return m == n or root_of(m) == root_of(n);
+  }
+
+  // -- union the sets in the partition, hanging the lower ranked root, unless
+  // -- they are distinct. Only the shorter disequality list is scanned.
+  // axiom: !in_same_set(m,n)
+  inline bool persistent_union_find_t::union_sets (size_t m, size_t n)
+  {
+    m = root_of(m);
+    n = root_of(n);
+    distinct_list_t longer = distinct[m];
+    distinct_list_t shorter = distinct[n];
+    size_t other = m;
+    if ((longer ? longer->length : 0) < (shorter ? shorter->length : 0)) {
+      std::swap(longer,shorter);
+      other = n; }
+    for (const distinct_link_t* l = shorter.get(); l; l = l->next.get())
+      if (root_of(l->var) == other)
+        return false;
+    for (const distinct_link_t* l = shorter.get(); l; l = l->next.get())
+      longer = std::make_shared<distinct_link_t>(distinct_link_t{
+        l->var, longer ? longer->length + 1 : 1, longer});
+    if (rank[m] < rank[n])
+      std::swap(m,n);
+    parent.set(n,m);
+    if (rank[m] == rank[n])
+      rank.set(m,rank[m] + 1);
+    distinct.set(m,longer);
+    if (distinct[n])
+      distinct.set(n,distinct_list_t());
+    return true;
+  }
+
+  // -- record that the sets of m and n are distinct
+  inline bool persistent_union_find_t::set_distinct (size_t m, size_t n)
+  {
+    if (in_same_set(m,n))
+      return false;
+    size_t rm = root_of(m);
+    size_t rn = root_of(n);
+    distinct_list_t lm = distinct[rm];
+    distinct_list_t ln = distinct[rn];
+    distinct.set(rm,std::make_shared<distinct_link_t>(distinct_link_t{
+      n, lm ? lm->length + 1 : 1, lm}));
+    distinct.set(rn,std::make_shared<distinct_link_t>(distinct_link_t{
+      m, ln ? ln->length + 1 : 1, ln}));
+    return true;
+  }
+
+  template <typename F>
+    void persistent_union_find_t::for_each_distinct (size_t n, F f) const
+    {
+      for (const distinct_link_t* l = distinct[root_of(n)].get(); l;
+           l = l->next.get())
+        f(l->var);
+    }
+
+  // -- return the number of elements visited by for_each_distinct
+  inline auto persistent_union_find_t::count_distinct (size_t n) const
+    -> size_t
+  {
+    const distinct_list_t& l = distinct[root_of(n)];
+    return l ? l->length : 0;
   }
 
   // -- return a fresh variable
-  size_t union_find_t::fresh_variable ()
+  inline auto persistent_union_find_t::fresh_variable () -> size_t
   {
     size_t var = parent.size();
     parent.push_back(var);
+    rank.push_back(0);
+    distinct.push_back(distinct_list_t());
     return var;
   }
 
+  // -- renumber the live elements into [0,k) as union_find_t::compact does.
+  // -- The result no longer shares any storage with its copies.
+  inline auto persistent_union_find_t::compact (const std::vector<bool>& live)
+    -> std::vector<size_t>
+  {
+    size_t dead = parent.size();
+    std::vector<size_t> renumbered(parent.size(),dead);
+    std::vector<size_t> new_root(parent.size(),dead);
+    size_t k = 0;
+    for (size_t i = 0; i < parent.size(); ++i)
+      if (live[i]) {
+        renumbered[i] = k++;
+        size_t r = root_of(i);
+        if (new_root[r] == dead)
+          new_root[r] = renumbered[i]; }
+
+    std::vector<std::vector<size_t>> new_distinct(k);
+    for (size_t i = 0; i < parent.size(); ++i) {
+      if (parent[i] != i or new_root[i] == dead)
+        continue;
+      std::vector<size_t>& d = new_distinct[new_root[i]];
+      for (const distinct_link_t* l = distinct[i].get(); l; l = l->next.get())
+        if (new_root[root_of(l->var)] != dead)
+          d.push_back(new_root[root_of(l->var)]);
+      std::sort(d.begin(),d.end());
+      d.erase(std::unique(d.begin(),d.end()),d.end()); }
+
+    persistent_union_find_t compacted;
+    for (size_t i = 0; i < parent.size(); ++i) {
+      if (!live[i])
+        continue;
+      size_t r = new_root[root_of(i)];
+      compacted.parent.push_back(r);
+      compacted.rank.push_back(r == renumbered[i] ? 1 : 0);
+      distinct_list_t l;
+      for (size_t x : new_distinct[renumbered[i]])
+        l = std::make_shared<distinct_link_t>(distinct_link_t{
+          x, l ? l->length + 1 : 1, l});
+      compacted.distinct.push_back(l); }
+
+    *this = compacted;
+    return renumbered;
+  }
+
+  inline void persistent_union_find_t::clear ()
+  {
+    *this = persistent_union_find_t();
+  }
+
+  inline auto persistent_union_find_t::memory_usage () const -> size_t
+  {
+    size_t bytes = parent.memory_usage() + rank.memory_usage()
+      + distinct.memory_usage();
+    for (size_t i = 0; i < distinct.size(); ++i)
+      if (distinct[i])
+        bytes += distinct[i]->length * sizeof(distinct_link_t);
+    return bytes;
+  }
+
   // -- get the canonical element of the set containing n
-  auto union_find_t::root_of (size_t n) -> size_t
+  inline auto persistent_union_find_t::root_of (size_t n) const -> size_t
   {
     size_t parent_of_n = parent[n];
     while (n != parent_of_n) {
@@ -266,6 +1075,139 @@ namespace dimitri {
 
 
 
+  // ----------------- //
+  // --- Node pool --- //
+  // ----------------- //
+
+  inline node_pool_t::node_pool_t ()
+    : block_size(0), capacity(0), pending(0), free_list(nullptr), chunks()
+  { }
+
+  inline node_pool_t::~node_pool_t ()
+  {
+    for (auto chunk : chunks)
+      ::operator delete(chunk);
+  }
+
+  // -- blocks hold a free list link and are aligned for any type
+  inline auto node_pool_t::round (size_t n) -> size_t
+  {
+    const size_t align = alignof(std::max_align_t);
+    n = std::max(n,sizeof(void*));
+    return (n + align - 1) / align * align;
+  }
+
+  // -- true iff blocks have the size of an n byte node; the first size asked
+  // -- about becomes the block size
+  inline bool node_pool_t::fits (size_t n)
+  {
+    if (block_size == 0) {
+      block_size = round(n);
+      reserve(pending); }
+    return round(n) == block_size;
+  }
+
+  // -- without a reservation the pool doubles
+  inline void* node_pool_t::allocate ()
+  {
+    if (!free_list)
+      grow(std::max<size_t>(capacity,16));
+    void* block = free_list;
+    free_list = *static_cast<void**>(block);
+    return block;
+  }
+
+  inline void node_pool_t::deallocate (void* block)
+  {
+    *static_cast<void**>(block) = free_list;
+    free_list = block;
+  }
+
+  // -- make room for n blocks in all
+  inline void node_pool_t::reserve (size_t n)
+  {
+    if (block_size == 0)
+      pending = std::max(pending,n);
+    else if (capacity < n)
+      grow(n - capacity);
+  }
+
+  inline void node_pool_t::grow (size_t n)
+  {
+    char* chunk = static_cast<char*>(::operator new(n * block_size));
+    chunks.push_back(chunk);
+    for (size_t i = n; i-- > 0;)
+      deallocate(chunk + i * block_size);
+    capacity += n;
+  }
+
+  template <typename T>
+    pool_allocator_t<T>::pool_allocator_t ()
+      : pool(std::make_shared<node_pool_t>())
+    { }
+
+  template <typename T>
+    pool_allocator_t<T>::pool_allocator_t (pool_allocator_t&& a)
+      : pool(std::move(a.pool))
+    {
+      a.pool = std::make_shared<node_pool_t>();
+    }
+
+  template <typename T>
+  template <typename U>
+    pool_allocator_t<T>::pool_allocator_t (const pool_allocator_t<U>& a)
+      : pool(a.pool)
+    { }
+
+  template <typename T>
+    auto pool_allocator_t<T>::operator= (pool_allocator_t&& a)
+      -> pool_allocator_t&
+    {
+      if (this != &a) {
+        pool = std::move(a.pool);
+        a.pool = std::make_shared<node_pool_t>(); }
+      return *this;
+    }
+
+  // -- only single nodes of the pool's block size come from the pool
+  template <typename T>
+    T* pool_allocator_t<T>::allocate (size_t n)
+    {
+      if (n == 1 and pool->fits(sizeof(T)))
+        return static_cast<T*>(pool->allocate());
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+  template <typename T>
+    void pool_allocator_t<T>::deallocate (T* p, size_t n)
+    {
+      if (n == 1 and pool->fits(sizeof(T)))
+        pool->deallocate(p);
+      else
+        ::operator delete(p);
+    }
+
+  template <typename T>
+    auto pool_allocator_t<T>::select_on_container_copy_construction () const
+      -> pool_allocator_t
+    {
+      return pool_allocator_t();
+    }
+
+  template <typename T, typename U>
+    bool operator== (const pool_allocator_t<T>& a, const pool_allocator_t<U>& b)
+    {
+      return a.pool == b.pool;
+    }
+
+  template <typename T, typename U>
+    bool operator!= (const pool_allocator_t<T>& a, const pool_allocator_t<U>& b)
+    {
+      return a.pool != b.pool;
+    }
+
+
+
   // ------------------------------ //
   // --- Canonical Element maps --- //
   // ------------------------------ //
@@ -300,42 +1242,301 @@ namespace dimitri {
       representatives.insert(std::make_pair(e,rep));
     }
 
+  template <typename Expr>
+    void canonical_map_t<Expr>::erase (expr_t e)
+    {
+      representatives.erase(e);
+    }
 
+  template <typename Expr>
+    void canonical_map_t<Expr>::clear ()
+    {
+      representatives.clear();
+    }
+
+  template <typename Expr>
+  template <typename F>
+    void canonical_map_t<Expr>::for_each (F f) const
+    {
+      for (const auto& r : representatives)
+        f(r.first,r.second);
+    }
+
+  // -- axiom: every mapped element is live in the renumbering
+  template <typename Expr>
+    void canonical_map_t<Expr>::renumber (const std::vector<size_t>& renumbered)
+    {
+      pooled_map_t<expr_t,size_t> survivors;
+      survivors.get_allocator().pool->reserve(representatives.size());
+      for (const auto& r : representatives)
+        survivors.emplace_hint(survivors.end(),r.first,renumbered[r.second]);
+      representatives.swap(survivors);
+    }
+
+  template <typename Expr>
+    void canonical_map_t<Expr>::reserve (size_t n)
+    {
+      representatives.get_allocator().pool->reserve(n);
+    }
+
+  template <typename Expr>
+    size_t canonical_map_t<Expr>::memory_usage () const
+    {
+      return representatives.get_allocator().pool->memory_usage();
+    }
+
+
+
+  // ---------------------- //
+  // --- Persistent map --- //
+  // ---------------------- //
+
+  template <typename K, typename V>
+    persistent_map_t<K,V>::node_t::node_t (
+      const K& key, const V& val, std::uint64_t priority,
+      std::shared_ptr<const node_t> left, std::shared_ptr<const node_t> right)
+      : key(key), val(val), priority(priority), left(left), right(right)
+    { }
+
+  template <typename K, typename V>
+    persistent_map_t<K,V>::persistent_map_t ()
+      : root(), count(0), seed(0)
+    { }
+
+  template <typename K, typename V>
+    maybe<V> persistent_map_t<K,V>::get (const K& k) const
+    {
+      const node_t* n = root.get();
+      while (n) {
+        if (k < n->key)
+          n = n->left.get();
+        else if (n->key < k)
+          n = n->right.get();
+        else
+          return maybe<V>(n->val); }
+      return maybe<V>();
+    }
+
+  // -- insert k unless it is already mapped, like std::map::insert
+  template <typename K, typename V>
+    void persistent_map_t<K,V>::insert (const K& k, const V& v)
+    {
+      root = insert_in(root,k,v,next_priority());
+    }
+
+  template <typename K, typename V>
+    auto persistent_map_t<K,V>::insert_in (
+      const node_ptr& n, const K& k, const V& v, std::uint64_t p) -> node_ptr
+    {
+      if (!n) {
+        ++count;
+        return std::make_shared<node_t>(k,v,p,nullptr,nullptr); }
+      if (k < n->key) {
+        node_ptr l = insert_in(n->left,k,v,p);
+        if (l == n->left)
+          return n;
+        if (n->priority < l->priority)
+          return std::make_shared<node_t>(l->key,l->val,l->priority,l->left,
+            std::make_shared<node_t>(n->key,n->val,n->priority,l->right,
+              n->right));
+        return std::make_shared<node_t>(n->key,n->val,n->priority,l,n->right);
+      }
+      if (n->key < k) {
+        node_ptr r = insert_in(n->right,k,v,p);
+        if (r == n->right)
+          return n;
+        if (n->priority < r->priority)
+          return std::make_shared<node_t>(r->key,r->val,r->priority,
+            std::make_shared<node_t>(n->key,n->val,n->priority,n->left,
+              r->left),
+            r->right);
+        return std::make_shared<node_t>(n->key,n->val,n->priority,n->left,r);
+      }
+      return n;
+    }
+
+  // -- each node also carries the control block of its shared_ptr
+  template <typename K, typename V>
+    auto persistent_map_t<K,V>::memory_usage () const -> size_t
+    {
+      return count * (sizeof(node_t) + 2 * sizeof(void*));
+    }
+
+  template <typename K, typename V>
+    void persistent_map_t<K,V>::erase (const K& k)
+    {
+      root = erase_in(root,k);
+    }
+
+  template <typename K, typename V>
+  template <typename F>
+    void persistent_map_t<K,V>::for_each (F f) const
+    {
+      for_each_in(root.get(),f);
+    }
+
+  template <typename K, typename V>
+  template <typename F>
+    void persistent_map_t<K,V>::for_each_in (const node_t* n, F& f)
+    {
+      if (!n)
+        return;
+      for_each_in(n->left.get(),f);
+      f(n->key,n->val);
+      for_each_in(n->right.get(),f);
+    }
+
+  template <typename K, typename V>
+    auto persistent_map_t<K,V>::erase_in (const node_ptr& n, const K& k)
+      -> node_ptr
+    {
+      if (!n)
+        return n;
+      if (k < n->key) {
+        node_ptr l = erase_in(n->left,k);
+        if (l == n->left)
+          return n;
+        return std::make_shared<node_t>(n->key,n->val,n->priority,l,n->right);
+      }
+      if (n->key < k) {
+        node_ptr r = erase_in(n->right,k);
+        if (r == n->right)
+          return n;
+        return std::make_shared<node_t>(n->key,n->val,n->priority,n->left,r);
+      }
+      --count;
+      return merge(n->left,n->right);
+    }
+
+  // -- join two treaps whose keys are ordered, copying along the spine
+  template <typename K, typename V>
+    auto persistent_map_t<K,V>::merge (const node_ptr& l, const node_ptr& r)
+      -> node_ptr
+    {
+      if (!l)
+        return r;
+      if (!r)
+        return l;
+      if (r->priority < l->priority)
+        return std::make_shared<node_t>(l->key,l->val,l->priority,l->left,
+          merge(l->right,r));
+      return std::make_shared<node_t>(r->key,r->val,r->priority,
+        merge(l,r->left),r->right);
+    }
+
+  // -- splitmix64; copies replay the same priorities, which is harmless
+  template <typename K, typename V>
+    std::uint64_t persistent_map_t<K,V>::next_priority ()
+    {
+      std::uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      return z ^ (z >> 31);
+    }
+
+
+
+  // ----------------------------------------- //
+  // --- Persistent canonical element maps --- //
+  // ----------------------------------------- //
+
+  template <typename Expr>
+    persistent_canonical_map_t<Expr>::persistent_canonical_map_t ()
+      : representatives()
+    { }
+
+  template <typename Expr>
+    maybe<size_t> persistent_canonical_map_t<Expr>::get (expr_t e)
+    {
+      return representatives.get(e);
+    }
+
+  template <typename Expr>
+    void persistent_canonical_map_t<Expr>::set (expr_t e, size_t rep)
+    {
+      representatives.insert(e,rep);
+    }
+
+  template <typename Expr>
+    void persistent_canonical_map_t<Expr>::erase (expr_t e)
+    {
+      representatives.erase(e);
+    }
+
+  template <typename Expr>
+    void persistent_canonical_map_t<Expr>::clear ()
+    {
+      representatives = persistent_map_t<expr_t,size_t>();
+    }
+
+  template <typename Expr>
+  template <typename F>
+    void persistent_canonical_map_t<Expr>::for_each (F f) const
+    {
+      representatives.for_each(f);
+    }
+
+  // -- axiom: every mapped element is live in the renumbering
+  template <typename Expr>
+    void persistent_canonical_map_t<Expr>::renumber (
+      const std::vector<size_t>& renumbered)
+    {
+      persistent_map_t<expr_t,size_t> r;
+      representatives.for_each([&](expr_t e, size_t c) {
+        r.insert(e,renumbered[c]); });
+      representatives = r;
+    }
+
+  template <typename Expr>
+    size_t persistent_canonical_map_t<Expr>::memory_usage () const
+    {
+      return representatives.memory_usage();
+    }
+
+
+
+  // ---------------------------- //
+  // --- Expression Traversal --- //
+  // ---------------------------- //
 
-  // ---------------------------- //
-  // --- Expression Traversal --- //
-  // ---------------------------- //
-
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags
   >
-  expr_traversal<Expr, Args, Same_symbol, Num_args>::expr_traversal (
+  expr_traversal<Expr, Args, Same_symbol, Num_args, Symbol_flags>
+    ::expr_traversal (
       const Args& args, const Same_symbol& is_same_symbol,
-      const Num_args& num_args)
-      : args(args), is_same_symbol(is_same_symbol), num_args(num_args)
+      const Num_args& num_args, const Symbol_flags& symbol_flags)
+      : args(args), is_same_symbol(is_same_symbol), num_args(num_args),
+        symbol_flags(symbol_flags)
     { }
 
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags
   >
     auto
-    expr_traversal<Expr, Args, Same_symbol, Num_args>::traverse
+    expr_traversal<Expr, Args, Same_symbol, Num_args, Symbol_flags>::traverse
       (expr_t e1, expr_t e2) -> std::vector<expr_pair_t>
     {
       std::vector<expr_pair_t> diffs;
-      if (!is_same_symbol(e1,e2))
+      if (!(e1 < e2) and !(e2 < e1))
+        return diffs;
+      if (!is_same_symbol(e1,e2)
+          or symbol_flags(e1) & (commutative_symbol | associative_symbol))
         diffs.push_back(std::make_pair(e1,e2));
       else {
         auto e1_args = begin(args(e1));
         auto e2_args = begin(args(e2));
-        for (size_t n = 0; n < num_args(e1); ++n, ++e1_args, ++e2_args)
-          traverse(*e1_args,*e2_args); }
+        for (size_t n = 0; n < num_args(e1); ++n, ++e1_args, ++e2_args) {
+          std::vector<expr_pair_t> nested = traverse(*e1_args,*e2_args);
+          diffs.insert(diffs.end(),nested.begin(),nested.end()); } }
       return diffs;
     }
 
@@ -349,42 +1550,72 @@ namespace dimitri {
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    congruence_t<Expr,Args,Same_symbol,Num_args>::congruence_t (
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::congruence_t (
       const Args& args, const Same_symbol& is_same_symbol,
-      const Num_args& num_args)
-      : args(args), is_same_symbol(is_same_symbol), num_args(num_args)
+      const Num_args& num_args, const Symbol_flags& symbol_flags)
+      : args(args), is_same_symbol(is_same_symbol), num_args(num_args),
+        symbol_flags(symbol_flags), caching(false), epoch(0),
+        forms(std::make_shared<canonical_forms_t>())
     { }
 
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    congruence_t<Expr,Args,Same_symbol,Num_args>::congruence_t (
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::congruence_t (
         const congruence_t& c)
-      : args(c.args), is_same_symbol(c.is_same_symbol), num_args(c.num_args)
+      : args(c.args), is_same_symbol(c.is_same_symbol), num_args(c.num_args),
+        symbol_flags(c.symbol_flags), reps(c.reps), sets(c.sets),
+        scope_terms(c.scope_terms), scopes(c.scopes), caching(c.caching),
+        epoch(c.epoch), forms(c.forms)
     { }
 
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    congruence_t<Expr,Args,Same_symbol,Num_args>::congruence_t (congruence_t&& c)
-      : args(c.args), is_same_symbol(c.is_same_symbol), num_args(c.num_args)
-    { }
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::congruence_t (
+        congruence_t&& c)
+      : args(c.args), is_same_symbol(c.is_same_symbol), num_args(c.num_args),
+        symbol_flags(c.symbol_flags), reps(std::move(c.reps)),
+        sets(std::move(c.sets)), scope_terms(std::move(c.scope_terms)),
+        scopes(std::move(c.scopes)), caching(c.caching), epoch(c.epoch),
+        cache(std::move(c.cache)),
+        forms(std::move(c.forms))
+    {
+      c.forms = std::make_shared<canonical_forms_t>();
+    }
 
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    bool congruence_t<Expr,Args,Same_symbol,Num_args>::is_congruent (
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::is_congruent (
       expr_t e1, expr_t e2)
     {
       // Can optimize by just looking for the first incongruence.
@@ -396,15 +1627,32 @@ namespace dimitri {
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    auto congruence_t<Expr,Args,Same_symbol,Num_args>::report_differences
-    (expr_t e1, expr_t e2) -> std::vector<expr_pair_t>
+    auto
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::report_differences
+      (expr_t e1, expr_t e2) -> std::vector<expr_pair_t>
     {
+      auto hit = cache.end();
+      if (caching) {
+        hit = cache.find(std::make_pair(e1,e2));
+        if (hit != cache.end() and
+            (hit->second.diffs.empty() or hit->second.epoch == epoch))
+          return hit->second.diffs; }
       auto diffs = differences(e1,e2);
       auto i = std::remove_if(begin(diffs), end(diffs),
         [this](expr_pair_t e) { return this->not_directly_congruent(e); });
       diffs.erase(i,diffs.end());
+      if (caching) {
+        cached_query_t answer = { epoch, diffs };
+        if (hit != cache.end())
+          hit->second = answer;
+        else
+          cache.insert(std::make_pair(std::make_pair(e1,e2),answer)); }
       return diffs;
     }
 
@@ -412,67 +1660,910 @@ namespace dimitri {
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    void congruence_t<Expr,Args,Same_symbol,Num_args>::set_congruent
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::set_congruent
       (expr_t e1, expr_t e2)
     {
       auto diffs = differences(e1,e2);
+      std::vector<std::pair<size_t,size_t>> pairs;
       for (auto e: diffs) {
         size_t c1 = get_or_gen_canonical(e.first);
         size_t c2 = get_or_gen_canonical(e.second);
         // oi. I really need a permission based type system.
         if (!sets.in_same_set(c1,c2))
-          sets.union_sets(c1,c2);
+          pairs.push_back(std::make_pair(c1,c2));
+      }
+      return merge(pairs);
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::set_distinct
+      (expr_t e1, expr_t e2)
+    {
+      if (is_congruent(e1,e2))
+        return false;
+      size_t c1 = get_or_gen_canonical(e1);
+      size_t c2 = get_or_gen_canonical(e2);
+      return sets.set_distinct(c1,c2);
+    }
+
+  // -- the shards are contiguous so that replaying them one after the other
+  // -- visits the equations in order. Each shard keeps, per equation, the terms
+  // -- first seen in it and the pairs that joined two of its local classes:
+  // -- any other pair is already implied by the ones before it. Replaying an
+  // -- equation generates its new terms and then merges its joins at once, so
+  // -- it makes the same merges, generates the same canonical elements and
+  // -- meets the same first contradiction as asserting every equation.
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::set_congruent
+      (const std::vector<expr_pair_t>& equations, size_t threads)
+    {
+      struct shard_t {
+        std::map<expr_t,size_t> ids;
+        std::vector<expr_t> terms;
+        std::vector<maybe<size_t>> known;
+        std::vector<std::pair<size_t,size_t>> joins;
+        std::vector<std::pair<size_t,size_t>> ends;  // per equation
+        union_find_t sets;
+      };
+      threads = std::max<size_t>(1,std::min(threads,equations.size()));
+      if (threads == 1) {
+        for (auto& e : equations)
+          if (!set_congruent(e.first,e.second))
+            return false;
+        return true; }
+      std::vector<shard_t> shards(threads);
+
+      // Partition each shard locally, and look up the terms that are already
+      // known. Lookups do not modify the map, so the shards can share it.
+      auto partition = [&](size_t n) {
+        shard_t& shard = shards[n];
+        auto local_id = [&](expr_t e) {
+          auto i = shard.ids.find(e);
+          if (i != shard.ids.end())
+            return i->second;
+          shard.terms.push_back(e);
+          shard.known.push_back(reps.get(e));
+          shard.ids.insert(std::make_pair(e,shard.sets.fresh_variable()));
+          return shard.terms.size() - 1;
+        };
+        size_t first = n * equations.size() / threads;
+        size_t last = (n + 1) * equations.size() / threads;
+        for (size_t i = first; i < last; ++i) {
+          for (auto e : differences(equations[i].first,equations[i].second)) {
+            size_t c1 = local_id(e.first);
+            size_t c2 = local_id(e.second);
+            if (shard.sets.in_same_set(c1,c2))
+              continue;
+            shard.sets.union_sets(c1,c2);
+            shard.joins.push_back(std::make_pair(c1,c2)); }
+          shard.ends.push_back(
+            std::make_pair(shard.terms.size(),shard.joins.size())); }
+        std::map<expr_t,size_t>().swap(shard.ids);
+      };
+      std::vector<std::thread> workers;
+      for (size_t n = 1; n < threads; ++n)
+        workers.push_back(std::thread(partition,n));
+      partition(0);
+      for (auto& w : workers)
+        w.join();
+
+      // Replay the equations in order, stopping at the first contradiction
+      for (auto& shard : shards) {
+        std::vector<size_t> global(shard.terms.size());
+        size_t k = 0;
+        size_t j = 0;
+        for (auto end : shard.ends) {
+          for (; k < end.first; ++k)
+            global[k] = shard.known[k].is_just
+              ? shard.known[k].val : get_or_gen_canonical(shard.terms[k]);
+          std::vector<std::pair<size_t,size_t>> pairs;
+          for (; j < end.second; ++j) {
+            size_t c1 = global[shard.joins[j].first];
+            size_t c2 = global[shard.joins[j].second];
+            if (!sets.in_same_set(c1,c2))
+              pairs.push_back(std::make_pair(c1,c2)); }
+          if (!pairs.empty() and !merge(pairs))
+            return false; }
       }
+      return true;
     }
 
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    auto congruence_t<Expr,Args,Same_symbol,Num_args>::differences
-    (expr_t e1, expr_t e2) -> std::vector<expr_pair_t>
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::release (expr_t e)
     {
-      using expr_trav = expr_traversal<Expr,Args,Same_symbol,Num_args>;
-      return expr_trav(args,is_same_symbol,num_args).traverse(e1,e2);
+      std::vector<size_t> touched;
+      forget(e,touched);
+      prune_uses(touched);
+      cache.clear();
+      ++epoch;
     }
 
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    size_t congruence_t<Expr,Args,Same_symbol,Num_args>::get_or_gen_canonical
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::push_scope ()
+    {
+      scopes.push_back(scope_terms.size());
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::pop_scope ()
+    {
+      if (scopes.empty())
+        return;
+      std::vector<size_t> touched;
+      for (size_t i = scopes.back(); i < scope_terms.size(); ++i)
+        forget(scope_terms[i],touched);
+      prune_uses(touched);
+      scope_terms.resize(scopes.back());
+      scopes.pop_back();
+      cache.clear();
+      ++epoch;
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::compact ()
+    {
+      std::vector<bool> live(sets.parent.size(),false);
+      reps.for_each([&](expr_t, size_t c) { live[c] = true; });
+      std::vector<size_t> old_root;
+      if (!forms->terms.empty())
+        for (size_t i = 0; i < live.size(); ++i)
+          old_root.push_back(sets.root_of(i));
+      std::vector<size_t> renumbered = sets.compact(live);
+      reps.renumber(renumbered);
+      ++epoch;
+
+      // Give back the storage of released entries
+      pooled_map_t<expr_pair_t,cached_query_t> queries;
+      queries.get_allocator().pool->reserve(cache.size());
+      queries.insert(cache.begin(),cache.end());
+      cache.swap(queries);
+      scope_terms.shrink_to_fit();
+      scopes.shrink_to_fit();
+      if (forms->terms.empty())
+        return;
+
+      // Move the canonical forms over to the new numbering. A form that
+      // mentions a class with no live terms left can no longer be matched.
+      const size_t dead = live.size();
+      std::vector<size_t> moved(live.size(),dead);
+      for (size_t i = 0; i < live.size(); ++i)
+        if (live[i])
+          moved[old_root[i]] = renumbered[i];
+      canonical_forms_t& f = writable_forms();
+      for (auto t = f.terms.begin(); t != f.terms.end(); ) {
+        bool matchable = true;
+        for (auto& c : t->second.flat_args) {
+          c = moved[old_root[c]];
+          matchable = matchable and c != dead; }
+        if (matchable)
+          ++t;
+        else
+          t = f.terms.erase(t); }
+      reindex_forms();
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::clear (bool keep_storage)
+    {
+      reps.clear();
+      sets.clear();
+      scope_terms.clear();
+      scopes.clear();
+      cache.clear();
+      if (forms.use_count() == 1) {
+        forms->terms.clear();
+        forms->signatures.clear();
+        forms->uses.clear(); }
+      else
+        forms = std::make_shared<canonical_forms_t>();
+      // Compacting an empty closure leaves it holding nothing
+      if (!keep_storage)
+        compact();
+    }
+
+  // -- disabling the cache drops its contents
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::enable_query_cache (bool enable)
+    {
+      caching = enable;
+      if (!enable)
+        cache.clear();
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::reserve (size_t terms, size_t equations)
+    {
+      sets.reserve(terms);
+      reps.reserve(terms);
+      cache.get_allocator().pool->reserve(equations);
+    }
+
+  // -- the nodes of unpooled maps are estimated at three links and a color
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    auto
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::memory_usage () const -> memory_usage_t
+    {
+      const size_t node = 4 * sizeof(void*);
+      memory_usage_t usage;
+      usage.sets = sets.memory_usage() + scopes.capacity() * sizeof(size_t)
+        + scope_terms.capacity() * sizeof(expr_t);
+      usage.reps = reps.memory_usage();
+      usage.cache = cache.get_allocator().pool->memory_usage();
+      for (const auto& q : cache)
+        usage.cache += q.second.diffs.capacity() * sizeof(expr_pair_t);
+      usage.canonical_forms = sizeof(canonical_forms_t);
+      for (const auto& t : forms->terms)
+        usage.canonical_forms += node + sizeof(t)
+          + t.second.flat_args.capacity() * sizeof(size_t)
+          + t.second.sig.capacity() * sizeof(size_t);
+      for (const auto& s : forms->signatures)
+        usage.canonical_forms += node + sizeof(s)
+          + s.first.capacity() * sizeof(size_t)
+          + s.second.capacity() * sizeof(expr_t);
+      for (const auto& u : forms->uses)
+        usage.canonical_forms += node + sizeof(u)
+          + u.second.capacity() * sizeof(expr_t);
+      return usage;
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    auto
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::differences
+      (expr_t e1, expr_t e2) -> std::vector<expr_pair_t>
+    {
+      using expr_trav =
+        expr_traversal<Expr,Args,Same_symbol,Num_args,Symbol_flags>;
+      return expr_trav(args,is_same_symbol,num_args,symbol_flags)
+        .traverse(e1,e2);
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    size_t
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::get_or_gen_canonical
       (expr_t e1)
     {
       maybe<size_t> c = reps.get(e1);
       if (c.is_just)
         return c.val;
-      size_t fresh_var = sets.fresh_variable();
-      reps.set(e1,fresh_var);
-      return fresh_var;
+      if (!scopes.empty())
+        scope_terms.push_back(e1);
+      if (!has_canonical_form(e1)) {
+        size_t fresh_var = sets.fresh_variable();
+        reps.set(e1,fresh_var);
+        return fresh_var; }
+
+      // Share the canonical element of a term with the same canonical form
+      theory_term_t term;
+      for (auto arg : flatten(e1))
+        term.flat_args.push_back(get_or_gen_canonical(arg));
+      term.sig = signature(e1,term.flat_args,
+        [this](size_t c) { return this->sets.root_of(c); });
+      maybe<size_t> same = find_signature(e1,term.sig);
+      size_t var = same.is_just ? same.val : sets.fresh_variable();
+      reps.set(e1,var);
+      canonical_forms_t& f = writable_forms();
+      f.signatures[term.sig].push_back(e1);
+      for (size_t n = 0; n < term.sig.size(); ++n)
+        if (n == 0 or term.sig[n] != term.sig[n - 1])
+          f.uses[term.sig[n]].push_back(e1);
+      f.terms[e1] = std::move(term);
+      return var;
     }
 
   template <
     typename Expr,
     typename Args,
     typename Same_symbol,
-    typename Num_args
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
   >
-    bool congruence_t<Expr,Args,Same_symbol,Num_args>::not_directly_congruent
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::not_directly_congruent
       (expr_pair_t e)
     {
-      maybe<size_t> c1 = reps.get(e.first);
-      maybe<size_t> c2 = reps.get(e.second);
+      maybe<size_t> c1 = get_canonical(e.first);
+      maybe<size_t> c2 = get_canonical(e.second);
       if (c1.is_just and c2.is_just)
         return sets.in_same_set(c1.val,c2.val);
+      // Terms unknown to the closure may still share a canonical form
+      if (has_canonical_form(e.first) and is_same_symbol(e.first,e.second))
+        return same_canonical_form(e.first,e.second);
       return false;
     }
 
+  // -- like get_or_gen_canonical, but never generates
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    maybe<size_t>
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::get_canonical
+      (expr_t e1)
+    {
+      maybe<size_t> c = reps.get(e1);
+      if (c.is_just or !has_canonical_form(e1))
+        return c;
+      std::vector<size_t> flat_args;
+      for (auto arg : flatten(e1)) {
+        maybe<size_t> a = get_canonical(arg);
+        if (a.is_nothing())
+          return maybe<size_t>();
+        flat_args.push_back(a.val); }
+      return find_signature(e1,signature(e1,flat_args,
+        [this](size_t c) { return this->sets.root_of(c); }));
+    }
+
+  // -- merge the classes of each pair, and then the classes of any two terms
+  // -- whose canonical forms come to coincide. The merges are first worked out
+  // -- over a tentative partition, so that none of them is made if any one of
+  // -- them contradicts a disequality.
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::merge
+      (const std::vector<std::pair<size_t,size_t>>& pairs)
+    {
+      // Without canonical forms, a single merge does not lead to others
+      if (pairs.size() == 1 and forms->terms.empty()) {
+        if (sets.in_same_set(pairs[0].first,pairs[0].second))
+          return true;
+        if (!sets.union_sets(pairs[0].first,pairs[0].second))
+          return false;
+        ++epoch;
+        return true; }
+
+      // The tentative partition joins roots of the current one. A root that
+      // has absorbed others keeps them as its group.
+      std::map<size_t,size_t> absorbed_by;
+      std::map<size_t,std::vector<size_t>> groups;
+      auto root = [&](size_t c) {
+        c = sets.root_of(c);
+        for (auto i = absorbed_by.find(c); i != absorbed_by.end();
+             i = absorbed_by.find(c))
+          c = i->second;
+        return c; };
+
+      // The tentative forms of the terms that were revisited, and the terms
+      // that took on each form
+      const canonical_forms_t& f = *forms;
+      std::map<expr_t,signature_t> resigned;
+      std::map<signature_t,std::vector<expr_t>> moved;
+      auto current = [&](expr_t t) -> const signature_t& {
+        auto r = resigned.find(t);
+        return r != resigned.end() ? r->second : f.terms.find(t)->second.sig; };
+      auto find_form = [&](expr_t t, const signature_t& sig) {
+        auto m = moved.find(sig);
+        if (m != moved.end())
+          for (expr_t u : m->second)
+            if ((u < t or t < u) and this->is_same_symbol(u,t)
+                and current(u) == sig)
+              return maybe<expr_t>(u);
+        auto s = f.signatures.find(sig);
+        if (s != f.signatures.end())
+          for (expr_t u : s->second)
+            if ((u < t or t < u) and this->is_same_symbol(u,t)
+                and resigned.count(u) == 0)
+              return maybe<expr_t>(u);
+        return maybe<expr_t>(); };
+
+      // The number of terms whose forms mention each tentative class
+      std::map<size_t,size_t> weights;
+      auto weight = [&](size_t c) -> size_t& {
+        auto w = weights.find(c);
+        if (w == weights.end()) {
+          auto u = f.uses.find(c);
+          w = weights.insert(std::make_pair(
+            c,u != f.uses.end() ? u->second.size() : 0)).first; }
+        return w->second; };
+
+      std::vector<std::pair<size_t,size_t>> pending(pairs);
+      std::vector<std::pair<size_t,size_t>> unions;
+      for (size_t next = 0; next < pending.size(); ++next) {
+        size_t m = root(pending[next].first);
+        size_t n = root(pending[next].second);
+        if (m == n)
+          continue;
+        // The class mentioned by fewer forms is the one absorbed
+        if (weight(m) < weight(n))
+          std::swap(m,n);
+        weight(m) += weight(n);
+        std::vector<size_t> group(1,n);
+        auto g = groups.find(n);
+        if (g != groups.end()) {
+          group.insert(group.end(),g->second.begin(),g->second.end());
+          groups.erase(g); }
+
+        // Only the side with fewer disequalities is scanned
+        auto count = [&](size_t c) {
+          size_t k = sets.count_distinct(c);
+          auto h = groups.find(c);
+          if (h != groups.end())
+            for (size_t r : h->second)
+              k += sets.count_distinct(r);
+          return k; };
+        size_t in_group = 0;
+        for (size_t r : group)
+          in_group += sets.count_distinct(r);
+        bool distinct = false;
+        auto scan = [&](size_t r, size_t other) {
+          sets.for_each_distinct(r,[&](size_t x) {
+            distinct = distinct or root(x) == other; }); };
+        if (in_group <= count(m))
+          for (size_t r : group)
+            scan(r,m);
+        else {
+          scan(m,n);
+          auto h = groups.find(m);
+          if (h != groups.end())
+            for (size_t r : h->second)
+              scan(r,n); }
+        if (distinct)
+          return false;
+        absorbed_by[n] = m;
+        auto& into = groups[m];
+        into.insert(into.end(),group.begin(),group.end());
+        unions.push_back(std::make_pair(m,n));
+
+        // Revisit the terms whose forms mention the group of n
+        for (size_t r : group) {
+          auto u = f.uses.find(r);
+          if (u == f.uses.end())
+            continue;
+          for (expr_t t : u->second) {
+            auto term = f.terms.find(t);
+            if (term == f.terms.end())
+              continue;
+            signature_t sig = signature(t,term->second.flat_args,root);
+            if (sig == current(t))
+              continue;
+            resigned[t] = sig;
+            moved[sig].push_back(t);
+            maybe<expr_t> same = find_form(t,sig);
+            if (same.is_just)
+              pending.push_back(std::make_pair(
+                reps.get(same.val).val,reps.get(t).val)); }
+        }
+      }
+
+      // Nothing contradicts a disequality, so commit. The union find picks
+      // its own survivors, which need not be the tentative roots, so the
+      // forms are recomputed against the roots it kept.
+      std::vector<size_t> joined;
+      for (auto u : unions) {
+        sets.union_sets(u.first,u.second);
+        joined.push_back(u.first);
+        joined.push_back(u.second);
+        ++epoch; }
+      if (f.terms.empty())
+        return true;
+      canonical_forms_t& w = writable_forms();
+      auto kept = [&](size_t c) { return sets.root_of(c); };
+      for (size_t r : joined) {
+        if (kept(r) == r)
+          continue;
+        auto from = w.uses.find(r);
+        if (from == w.uses.end())
+          continue;
+        std::vector<expr_t> moving;
+        moving.swap(from->second);
+        w.uses.erase(from);
+        for (expr_t t : moving) {
+          auto term = w.terms.find(t);
+          if (term == w.terms.end())
+            continue;
+          signature_t sig = signature(t,term->second.flat_args,kept);
+          if (sig == term->second.sig)
+            continue;
+          auto s = w.signatures.find(term->second.sig);
+          s->second.erase(std::find_if(s->second.begin(),s->second.end(),
+            [&](expr_t u) { return !(u < t) and !(t < u); }));
+          if (s->second.empty())
+            w.signatures.erase(s);
+          w.signatures[sig].push_back(t);
+          term->second.sig = std::move(sig); }
+        // The shorter use list is moved onto the longer one
+        auto& into = w.uses[kept(r)];
+        if (into.size() < moving.size())
+          into.swap(moving);
+        into.insert(into.end(),moving.begin(),moving.end()); }
+      return true;
+    }
+
+  // -- drop a term from the canonical element map, along with its canonical
+  // -- form. The roots whose use lists mention it are added to touched, for
+  // -- prune_uses to clean up once a whole batch of terms is forgotten.
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::forget
+      (expr_t e1, std::vector<size_t>& touched)
+    {
+      reps.erase(e1);
+      if (!has_canonical_form(e1) or forms->terms.count(e1) == 0)
+        return;
+      canonical_forms_t& f = writable_forms();
+      auto t = f.terms.find(e1);
+      auto s = f.signatures.find(t->second.sig);
+      s->second.erase(std::find_if(s->second.begin(),s->second.end(),
+        [&](expr_t u) { return !(u < e1) and !(e1 < u); }));
+      if (s->second.empty())
+        f.signatures.erase(s);
+      touched.insert(touched.end(),t->second.sig.begin(),t->second.sig.end());
+      f.terms.erase(t);
+    }
+
+  // -- drop the forgotten terms from the use lists of the given roots
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::prune_uses
+      (std::vector<size_t>& touched)
+    {
+      if (touched.empty())
+        return;
+      std::sort(touched.begin(),touched.end());
+      touched.erase(std::unique(touched.begin(),touched.end()),touched.end());
+      canonical_forms_t& f = writable_forms();
+      for (size_t r : touched) {
+        auto u = f.uses.find(r);
+        if (u == f.uses.end())
+          continue;
+        u->second.erase(std::remove_if(u->second.begin(),u->second.end(),
+          [&](expr_t t) { return f.terms.count(t) == 0; }),u->second.end());
+        if (u->second.empty())
+          f.uses.erase(u); }
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::is_theory_term
+      (expr_t e1)
+    {
+      return symbol_flags(e1) & (commutative_symbol | associative_symbol);
+    }
+
+  // -- true for applications, whose canonical forms are their symbols applied
+  // -- to the canonical elements of their (flattened) arguments
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::has_canonical_form
+      (expr_t e1)
+    {
+      return num_args(e1) != 0 or is_theory_term(e1);
+    }
+
+  // -- the arguments of e1, with nested applications of an associative symbol
+  // -- spliced in
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    auto
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::flatten
+      (expr_t e1) -> std::vector<expr_t>
+    {
+      std::vector<expr_t> flat_args;
+      bool associative = symbol_flags(e1) & associative_symbol;
+      auto e1_args = begin(args(e1));
+      for (size_t n = 0; n < num_args(e1); ++n, ++e1_args) {
+        if (associative and is_same_symbol(*e1_args,e1)) {
+          std::vector<expr_t> nested = flatten(*e1_args);
+          flat_args.insert(flat_args.end(),nested.begin(),nested.end()); }
+        else
+          flat_args.push_back(*e1_args); }
+      return flat_args;
+    }
+
+  // -- the roots of the canonical elements of the flattened arguments, sorted
+  // -- if the symbol is commutative. root maps an element to its root.
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+  template <typename Root>
+    auto
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::signature
+      (expr_t e1, const std::vector<size_t>& flat_args, Root root)
+      -> signature_t
+    {
+      signature_t sig;
+      for (size_t c : flat_args)
+        sig.push_back(root(c));
+      if (symbol_flags(e1) & commutative_symbol)
+        std::sort(sig.begin(),sig.end());
+      return sig;
+    }
+
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    maybe<size_t>
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::find_signature
+      (expr_t e1, const signature_t& sig)
+    {
+      auto i = forms->signatures.find(sig);
+      if (i == forms->signatures.end())
+        return maybe<size_t>();
+      for (expr_t t : i->second)
+        if (is_same_symbol(t,e1))
+          return reps.get(t);
+      return maybe<size_t>();
+    }
+
+  // -- true iff the flattened arguments are pairwise congruent, in some order
+  // -- if the symbol is commutative
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    bool
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::same_canonical_form
+      (expr_t e1, expr_t e2)
+    {
+      std::vector<expr_t> args1 = flatten(e1);
+      std::vector<expr_t> args2 = flatten(e2);
+      if (args1.size() != args2.size())
+        return false;
+      bool commutative = symbol_flags(e1) & commutative_symbol;
+      std::vector<bool> matched(args2.size(),false);
+      for (size_t n = 0; n < args1.size(); ++n) {
+        size_t k = commutative ? 0 : n;
+        size_t last = commutative ? args2.size() : n + 1;
+        while (k < last and (matched[k] or !is_congruent(args1[n],args2[k])))
+          ++k;
+        if (k == last)
+          return false;
+        matched[k] = true; }
+      return true;
+    }
+
+  // -- the canonical forms, copied first if a copy of the closure shares them
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    auto
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::writable_forms () -> canonical_forms_t&
+    {
+      if (forms.use_count() != 1)
+        forms = std::make_shared<canonical_forms_t>(*forms);
+      return *forms;
+    }
+
+  // -- recompute every form, the terms with each form and the use lists from
+  // -- the canonical elements of the flattened arguments
+  template <
+    typename Expr,
+    typename Args,
+    typename Same_symbol,
+    typename Num_args,
+    typename Symbol_flags,
+    typename Reps,
+    typename Sets
+  >
+    void
+    congruence_t<Expr,Args,Same_symbol,Num_args,Symbol_flags,Reps,Sets>
+    ::reindex_forms ()
+    {
+      canonical_forms_t& f = writable_forms();
+      f.signatures.clear();
+      f.uses.clear();
+      for (auto& t : f.terms) {
+        signature_t& sig = t.second.sig;
+        sig = signature(t.first,t.second.flat_args,
+          [this](size_t c) { return this->sets.root_of(c); });
+        f.signatures[sig].push_back(t.first);
+        for (size_t n = 0; n < sig.size(); ++n)
+          if (n == 0 or sig[n] != sig[n - 1])
+            f.uses[sig[n]].push_back(t.first); }
+    }
+
 
 
 }
@@ -0,0 +1,76 @@
+// Copyright 2013 Michael Lopez
+//
+//    Licensed under the Apache License, Version 2.0 (the "License");
+//    you may not use this file except in compliance with the License.
+//    You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//    Unless required by applicable law or agreed to in writing, software
+//    distributed under the License is distributed on an "AS IS" BASIS,
+//    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//    See the License for the specific language governing permissions and
+//    limitations under the License.
+
+
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include "parser.hpp"
+#include "../../congruence/congruence.hpp"
+
+
+using namespace std;
+
+using congruence_t = dimitri::congruence_t<expr*, Args, Is_same, Num_args>;
+
+// Seconds taken by f
+template <typename F>
+double seconds (F f)
+{
+  auto start = chrono::steady_clock::now();
+  f();
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+
+
+// Bulk construction against asserting the equations one at a time, over
+// random equations between constants and between applications of them
+//
+//   usage: bench [terms] [equations]
+int main (int argc, char** argv)
+{
+  size_t num_terms = argc > 1 ? atol(argv[1]) : 200000;
+  size_t num_equations = argc > 2 ? atol(argv[2]) : 1000000;
+
+  // Expressions
+  vector<expr*> terms;
+  for (size_t n = 0; n < num_terms; ++n) {
+    terms.push_back(new expr("v" + to_string(n)));
+    if (n % 4 == 3)
+      terms.back() = new expr("f",vector<expr*>{terms[n - 1]}); }
+
+  // Equations
+  mt19937 random(1);
+  uniform_int_distribution<size_t> pick(0,num_terms - 1);
+  vector<pair<expr*,expr*>> equations;
+  for (size_t n = 0; n < num_equations; ++n)
+    equations.push_back(make_pair(terms[pick(random)],terms[pick(random)]));
+
+  cout << num_terms << " terms, " << num_equations << " equations, "
+       << thread::hardware_concurrency() << " hardware threads" << endl;
+  double in_order = seconds([&] {
+    congruence_t eq;
+    for (auto e : equations)
+      eq.set_congruent(e.first,e.second); });
+  cout << "in order   " << in_order << " s" << endl;
+  for (size_t threads : {1, 2, 4, 8}) {
+    double bulk = seconds([&] {
+      congruence_t eq;
+      eq.set_congruent(equations,threads); });
+    cout << "threads " << threads << "  " << bulk << " s  (x"
+         << in_order / bulk << ")" << endl; }
+}
@@ -77,6 +77,12 @@ expr* expr_parser_t::parse (const std::string& str)
   return e;
 }
 
+// -- presize the memory pool for n expressions
+void expr_parser_t::reserve (std::size_t n)
+{
+  mem.reserve(n);
+}
+
 expr* expr_parser_t::parse_expr ()
 {
   remove_whitespace();
@@ -88,6 +88,7 @@ struct expr_parser_t {
   ~expr_parser_t ();
 
   expr* parse (const std::string&);
+  void reserve (std::size_t);
   expr* parse_expr ();
   detail::maybe<std::vector<expr*>> parse_params ();
   std::vector<expr*> parse_args ();
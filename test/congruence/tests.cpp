@@ -16,13 +16,35 @@
 
 #include <iostream>
 #include <cassert>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
 #include "parser.hpp"
 #include "../../congruence/congruence.hpp"
+#include "../../congruence/batch.hpp"
 
 
 using namespace std;
 
 using congruence_t = dimitri::congruence_t<expr*, Args, Is_same, Num_args>;
+using persistent_congruence_t =
+  dimitri::persistent_congruence_t<expr*, Args, Is_same, Num_args>;
+
+// plus is associative and commutative, pair is only commutative
+struct Ac_flags {
+  unsigned operator() (expr* e) {
+    if (e->name == "plus")
+      return dimitri::commutative_symbol | dimitri::associative_symbol;
+    if (e->name == "pair")
+      return dimitri::commutative_symbol;
+    return 0;
+  }
+};
+
+using ac_congruence_t =
+  dimitri::congruence_t<expr*, Args, Is_same, Num_args, Ac_flags>;
+using persistent_ac_congruence_t =
+  dimitri::persistent_congruence_t<expr*, Args, Is_same, Num_args, Ac_flags>;
 
 
 
@@ -33,18 +55,22 @@ void simple_test ()
   expr_parser_t parser(mem_pool);
   congruence_t eq;
 
-  // Expressions
-  auto fa =    parser.parse( "f(a)"          );
-  auto ffa =   parser.parse( "f(f(a))"       );
-  auto ffffa = parser.parse( "f(f(f(f(a))))" );
+  // Expressions share their subterms, so they are built by hand
+  auto app = [&](const char* f, expr* x) {
+    mem_pool.push_back(new expr(f,std::vector<expr*>{x}));
+    return mem_pool.back(); };
+  auto a =     parser.parse( "a()"           );
+  auto fa =    app( "f", a                   );
+  auto ffa =   app( "f", fa                  );
+  auto ffffa = app( "f", app("f",ffa)        );
   auto k =     parser.parse( "k()"           );
   auto b =     parser.parse( "b()"           );
   auto c =     parser.parse( "c()"           );
   auto d =     parser.parse( "d()"           );
   auto e =     parser.parse( "e()"           );
   auto t =     parser.parse( "t()"           );
-  auto ggt =   parser.parse( "g(g(t))"       );
-  auto gggt =  parser.parse( "g(g(g(t)))"    );
+  auto ggt =   app( "g", app("g",t)          );
+  auto gggt =  app( "g", ggt                 );
 
   // Equality axioms
   eq.set_congruent(fa,ffa);
@@ -64,8 +90,535 @@ void simple_test ()
 
 
 
+// Forks of a persistent congruence_t are independent
+void persistent_test ()
+{
+  std::vector<expr*> mem_pool;
+  expr_parser_t parser(mem_pool);
+  persistent_congruence_t base;
+
+  // Expressions
+  auto a = parser.parse( "a()" );
+  auto b = parser.parse( "b()" );
+  auto c = parser.parse( "c()" );
+  auto d = parser.parse( "d()" );
+
+  // Enough terms to grow the underlying tries a few levels, with distinct
+  // names spelled out in letters
+  std::vector<expr*> xs;
+  for (auto n = 0; n < 100; ++n) {
+    std::string name = "x";
+    for (auto m = n; m; m /= 26)
+      name.push_back('a' + m % 26);
+    xs.push_back(parser.parse(name + "()"));
+    base.set_congruent(a,xs.back()); }
+  base.set_congruent(b,c);
+
+  // Branches
+  persistent_congruence_t left(base);
+  persistent_congruence_t right(base);
+  left.set_congruent(a,b);
+  right.set_congruent(c,d);
+
+  // Truths                                     because
+  assert(( base.is_congruent(xs[0],xs[99]) ));  // shared by every fork
+  assert(( left.is_congruent(xs[7],c) ));       // a = b in the left fork
+  assert(( right.is_congruent(b,d) ));          // c = d in the right fork
+
+  // Fallicies                                  because
+  assert(( !base.is_congruent(a,b) ));          // forks do not write back
+  assert(( !left.is_congruent(b,d) ));          // c = d is only on the right
+  assert(( !right.is_congruent(a,c) ));         // a = b is only on the left
+  assert(( !right.is_congruent(xs[7],d) ));     // xs[7] = a only
+
+  // A fresh fork reaches exactly the storage of its base
+  persistent_congruence_t fork(base);
+  assert(( fork.sets.parent.root == base.sets.parent.root ));
+  assert(( fork.memory_usage().total() == base.memory_usage().total() ));
+}
+
+
+
+// Disequalities are checked as they are asserted
+template <typename Congruence>
+void distinct_test ()
+{
+  std::vector<expr*> mem_pool;
+  expr_parser_t parser(mem_pool);
+  Congruence eq;
+
+  // Expressions
+  auto a = parser.parse( "a()" );
+  auto b = parser.parse( "b()" );
+  auto c = parser.parse( "c()" );
+  auto d = parser.parse( "d()" );
+  auto e = parser.parse( "e()" );
+
+  // Axioms                               because
+  assert(( eq.set_distinct(a,d) ));       // nothing is known yet
+  assert(( eq.set_congruent(a,b) ));      // b is not distinct from a
+  assert(( eq.set_congruent(c,d) ));      // c is not distinct from d
+  assert(( eq.set_distinct(e,c) ));       // e is not known to equal c
+  assert(( !eq.set_congruent(b,c) ));     // would equate a and d
+  assert(( !eq.set_congruent(d,e) ));     // would equate c and e
+  assert(( !eq.set_distinct(b,a) ));      // a = b
+
+  // Rejected assertions are not recorded
+  assert(( !eq.is_congruent(a,d) ));
+  assert(( !eq.is_congruent(c,e) ));
+
+  // Applications are compared through their arguments, and stay distinct
+  auto app = [&](expr* x) {
+    mem_pool.push_back(new expr("f",std::vector<expr*>{x}));
+    return mem_pool.back(); };
+  Congruence apps;
+  assert(( apps.set_distinct(app(a),app(b)) ));  // a and b may differ
+  assert(( !apps.set_congruent(a,b) ));          // would equate f(a), f(b)
+  assert(( apps.set_congruent(b,c) ));
+  assert(( !apps.set_distinct(app(b),app(c)) )); // b = c
+  assert(( !apps.is_congruent(app(a),app(c)) ));
+}
+
+
+
+// Released terms are reclaimed without losing equalities
+template <typename Congruence>
+void compact_test ()
+{
+  std::vector<expr*> mem_pool;
+  expr_parser_t parser(mem_pool);
+  Congruence eq;
+
+  // Expressions
+  auto a = parser.parse( "a()" );
+  auto b = parser.parse( "b()" );
+  auto c = parser.parse( "c()" );
+  auto d = parser.parse( "d()" );
+  auto x = parser.parse( "x()" );
+  auto y = parser.parse( "y()" );
+  auto z = parser.parse( "z()" );
+
+  // Axioms
+  eq.set_congruent(a,b);
+  eq.set_congruent(b,c);
+  eq.set_distinct(c,d);
+  eq.push_scope();
+  eq.set_congruent(x,y);
+  eq.set_congruent(y,a);
+  eq.push_scope();
+  eq.set_congruent(z,d);
+
+  // Reclaim b and the terms of the inner scope
+  eq.release(b);
+  eq.pop_scope();
+  eq.compact();
+  assert(( eq.sets.parent.size() == 5 ));  // a, c, d, x, y
+
+  // Truths                               because
+  assert(( eq.is_congruent(a,c) ));       // b linked them
+  assert(( eq.is_congruent(x,c) ));       // y linked x to a
+  assert(( !eq.set_congruent(d,y) ));     // c and d are still distinct
+
+  // Fallicies                            because
+  assert(( !eq.is_congruent(z,d) ));      // z was released with its scope
+
+  // The outer scope survives the renumbering
+  eq.pop_scope();
+  eq.compact();
+  assert(( eq.sets.parent.size() == 3 ));  // a, c, d
+  assert(( eq.is_congruent(a,c) ));
+  assert(( !eq.is_congruent(x,a) ));
+
+  // Popping with no scope open keeps everything
+  eq.pop_scope();
+  assert(( eq.sets.parent.size() == 3 ));
+  assert(( eq.is_congruent(a,c) ));
+}
+
+
+
+// Independent problems solved in parallel come back in order
+void batch_test ()
+{
+  std::vector<expr*> mem_pool;
+  expr_parser_t parser(mem_pool);
+
+  // Problem n chains a = b = c = ..., except for one broken link. The query
+  // between the ends holds when the break falls outside the chain.
+  struct problem_t {
+    std::vector<expr*> chain;
+    std::size_t broken;
+  };
+  std::vector<problem_t> problems(200);
+  for (auto n = 0u; n < problems.size(); ++n) {
+    for (auto k = 0u; k < 3 + n % 5; ++k)
+      problems[n].chain.push_back(parser.parse(std::string(1,'a' + k) + "()"));
+    problems[n].broken = 1 + n % 4;
+  }
+  auto expected = [&](std::size_t n) {
+    return problems[n].broken >= problems[n].chain.size() ? 1 : 0;
+  };
+
+  // The first problem of worker 0 waits until another worker has stolen the
+  // last problem of worker 0
+  std::atomic<bool> stolen(false);
+  auto solve = [&](congruence_t& eq, const problem_t& p) {
+    if (&p == &problems[0])
+      for (auto waited = 0; !stolen and waited < 10000; ++waited)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (&p == &problems[49])
+      stolen = true;
+    for (auto k = 1u; k < p.chain.size(); ++k)
+      if (k != p.broken)
+        eq.set_congruent(p.chain[k - 1],p.chain[k]);
+    return eq.is_congruent(p.chain.front(),p.chain.back()) ? 1 : 0;
+  };
+
+  std::vector<int> answers;
+  dimitri::batch_solver_t<congruence_t> batch(4);
+  batch.solve(problems,solve,[&](std::size_t n, int answer) {
+    assert(( n == answers.size() ));    // results stream out in order
+    answers.push_back(answer); });
+
+  assert(( stolen ));
+  assert(( answers.size() == problems.size() ));
+  for (auto n = 0u; n < answers.size(); ++n)
+    assert(( answers[n] == expected(n) ));
+
+  // A failure is rethrown, and nothing after it is emitted
+  auto failing = [&](congruence_t& eq, const problem_t& p) {
+    if (&p == &problems[120])
+      throw std::runtime_error("unsolvable");
+    return solve(eq,p);
+  };
+  bool rethrown = false;
+  std::size_t emitted = 0;
+  try {
+    batch.solve(problems,failing,[&](std::size_t n, int answer) {
+      assert(( n == emitted and n < 120 ));
+      assert(( answer == expected(n) ));
+      ++emitted; });
+  }
+  catch (std::runtime_error&) {
+    rethrown = true;
+  }
+  assert(( rethrown ));
+}
+
+
+
+// Cached answers are kept or dropped as the closure changes
+template <typename Congruence>
+void cache_test ()
+{
+  std::vector<expr*> mem_pool;
+  expr_parser_t parser(mem_pool);
+  Congruence eq;
+  eq.enable_query_cache();
+
+  // Expressions
+  auto a = parser.parse( "a()" );
+  auto b = parser.parse( "b()" );
+  auto c = parser.parse( "c()" );
+
+  // Negative answers only last until the next merge
+  eq.set_congruent(a,b);
+  assert(( !eq.is_congruent(a,c) ));
+  assert(( !eq.is_congruent(a,c) ));
+  eq.set_congruent(b,c);
+  assert(( eq.is_congruent(a,c) ));
+  assert(( eq.cache.size() == 1 ));
+
+  // Copies start empty, and positive answers last until a release
+  Congruence fork(eq);
+  assert(( fork.cache.empty() ));
+  assert(( fork.is_congruent(a,c) ));
+  eq.release(c);
+  assert(( !eq.is_congruent(a,c) ));
+
+  // Moving hands the cache over, and the source keeps a pool of its own
+  auto pool = eq.cache.get_allocator().pool;
+  Congruence moved(std::move(eq));
+  assert(( moved.cache.get_allocator().pool == pool ));
+  assert(( eq.cache.get_allocator().pool != pool ));
+  assert(( !eq.is_congruent(a,c) ));
+  assert(( moved.is_congruent(a,b) ));
+}
+
+
+
+// Building a closure in parallel matches building it in order
+void parallel_test ()
+{
+  std::vector<expr*> mem_pool;
+  expr_parser_t parser(mem_pool);
+
+  // Expressions with distinct names, spelled out in letters
+  std::vector<expr*> vs;
+  for (auto n = 0; n < 300; ++n) {
+    std::string name = "v";
+    for (auto m = n; m; m /= 26)
+      name.push_back('a' + m % 26);
+    vs.push_back(parser.parse(name + "()")); }
+  auto d = parser.parse( "d()" );
+  auto e = parser.parse( "e()" );
+
+  // Equations between pseudo-random terms
+  std::vector<std::pair<expr*,expr*>> equations;
+  for (auto n = 0u; n < 250; ++n)
+    equations.push_back(std::make_pair(vs[n * 7 % 300],vs[n * 13 % 299]));
+
+  // Same canonical elements and the same partition
+  {
+    congruence_t in_order;
+    congruence_t in_parallel;
+    for (auto eq : equations)
+      in_order.set_congruent(eq.first,eq.second);
+    assert(( in_parallel.set_congruent(equations,4) ));
+    assert(( in_parallel.reps.representatives
+             == in_order.reps.representatives ));
+    assert(( !in_order.is_congruent(vs[0],vs[1]) ));
+    assert(( in_order.is_congruent(vs[7],vs[13]) ));
+    for (auto v : vs)
+      for (auto w : vs)
+        assert(( in_parallel.is_congruent(v,w) == in_order.is_congruent(v,w) ));
+  }
+
+  // d and e are distinct, and two equations in the third shard link them.
+  // Only the equations before the second one are kept.
+  equations.insert(equations.begin() + 160,std::make_pair(d,vs[5]));
+  equations.insert(equations.begin() + 180,std::make_pair(vs[5],e));
+  {
+    congruence_t in_order;
+    congruence_t in_parallel;
+    in_order.set_distinct(d,e);
+    in_parallel.set_distinct(d,e);
+    auto n = 0u;
+    while (in_order.set_congruent(equations[n].first,equations[n].second))
+      ++n;
+    assert(( n == 180 ));
+    assert(( !in_parallel.set_congruent(equations,4) ));
+    assert(( in_parallel.reps.representatives
+             == in_order.reps.representatives ));
+    assert(( in_parallel.is_congruent(d,vs[5]) ));
+    assert(( !in_parallel.is_congruent(vs[5],e) ));
+    for (auto v : vs)
+      for (auto w : vs)
+        assert(( in_parallel.is_congruent(v,w) == in_order.is_congruent(v,w) ));
+  }
+}
+
+
+
+// Terms of AC symbols are compared through their canonical forms
+template <typename Congruence>
+void ac_test ()
+{
+  std::vector<expr*> mem_pool;
+  expr_parser_t parser(mem_pool);
+  Congruence eq;
+
+  // Expressions share their leaves, so they are built by hand
+  auto a = parser.parse( "a()" );
+  auto b = parser.parse( "b()" );
+  auto c = parser.parse( "c()" );
+  auto d = parser.parse( "d()" );
+  auto k = parser.parse( "k()" );
+  auto m = parser.parse( "m()" );
+  auto n = parser.parse( "n()" );
+  auto app = [&](const char* f, expr* x, expr* y) {
+    mem_pool.push_back(new expr(f,std::vector<expr*>{x,y}));
+    return mem_pool.back(); };
+  auto ab =     app( "plus", a, b                 );
+  auto ba =     app( "plus", b, a                 );
+  auto cb =     app( "plus", c, b                 );
+  auto a_bc =   app( "plus", a, app("plus",b,c)   );
+  auto cb_a =   app( "plus", app("plus",c,b), a   );
+  auto ca_b =   app( "plus", app("plus",c,a), b   );
+  auto p_ab =   app( "pair", a, b                 );
+  auto p_ba =   app( "pair", b, a                 );
+  auto p_a_bc = app( "pair", a, app("pair",b,c)   );
+  auto p_ab_c = app( "pair", app("pair",a,b), c   );
+  auto ab2 =    app( "plus", a, b                 );
+
+  // Terms the closure has never seen are compared through their arguments
+  assert(( eq.is_congruent(ab,ba) ));
+  assert(( eq.is_congruent(ab,ab2) ));
+  assert(( !eq.is_congruent(ab,cb) ));
+
+  // including under free symbols
+  auto g = [&](expr* x) {
+    mem_pool.push_back(new expr("g",std::vector<expr*>{x}));
+    return mem_pool.back(); };
+  Congruence nested;
+  assert(( nested.is_congruent(g(ab),g(ba)) ));
+  assert(( !nested.is_congruent(g(ab),g(cb)) ));
+  assert(( nested.set_distinct(g(ab),g(cb)) ));
+  assert(( !nested.set_congruent(a,c) ));  // would equate g(a+b), g(c+b)
+
+  // Equality axioms
+  eq.set_congruent(ab,k);
+  eq.set_congruent(a_bc,m);
+  eq.set_congruent(cb,n);
+  eq.set_congruent(p_a_bc,k);
+
+  // Truths                               because
+  assert(( eq.is_congruent(ba,k) ));      // plus is commutative
+  assert(( eq.is_congruent(cb_a,m) ));    // plus is also associative
+  assert(( eq.is_congruent(ca_b,m) ));
+  assert(( eq.is_congruent(p_ba,p_ab) )); // pair is commutative
+  assert(( eq.is_congruent(ba,ba) ));     // congruency is reflexive
+
+  // Fallicies                            because
+  assert(( !eq.is_congruent(p_ab,k) ));   // pair is not plus
+  assert(( !eq.is_congruent(p_ab_c,k) )); // pair is not associative
+  assert(( !eq.is_congruent(n,k) ));      // b and c are not known equal
+
+  // A fork shares the canonical forms until it changes them
+  Congruence fork(eq);
+  assert(( fork.forms == eq.forms ));
+
+  // Merges propagate to canonical forms
+  eq.set_congruent(c,a);
+  assert(( eq.is_congruent(n,k) ));       // c + b = a + b
+  assert(( eq.is_congruent(p_ab_c,k) ));  // pair(pair(a,b),a) = p_a_bc
+  assert(( fork.forms != eq.forms ));
+  assert(( !fork.is_congruent(n,k) ));
+
+  // A merge whose consequences contradict a disequality is not made at all
+  assert(( fork.set_distinct(k,n) ));
+  assert(( !fork.set_congruent(a,c) ));
+  assert(( !fork.is_congruent(a,c) ));
+  assert(( !fork.is_congruent(ab,cb) ));
+  assert(( fork.set_congruent(a,ab2) ));
+
+  // Bulk construction generates each equation's terms when it replays it, so
+  // canonical forms share elements just as they do in order
+  {
+    std::vector<std::pair<expr*,expr*>> equations = {
+      std::make_pair(a,c), std::make_pair(ab,k), std::make_pair(cb,m) };
+    Congruence in_order;
+    Congruence in_bulk;
+    for (auto eq : equations)
+      in_order.set_congruent(eq.first,eq.second);
+    assert(( in_bulk.set_congruent(equations,3) ));
+    for (auto t : {a,b,c,k,m,ab,cb})
+      assert(( in_bulk.reps.get(t).val == in_order.reps.get(t).val ));
+    assert(( in_bulk.is_congruent(k,m) ));
+  }
+
+  // The union find may keep either root of a merge. Here c has the higher
+  // rank, so the persistent union find keeps it over a.
+  Congruence ranked;
+  ranked.set_congruent(c,d);
+  ranked.set_congruent(ab,k);
+  ranked.set_congruent(cb,k);
+  assert(( ranked.set_congruent(a,c) ));
+  assert(( ranked.is_congruent(ba,k) ));
+  assert(( ranked.is_congruent(app("plus",b,c),k) ));
+  assert(( ranked.is_congruent(app("plus",b,d),k) ));
+
+  // Terms first seen in a scope leave with it, even when they share the
+  // canonical element of an older term
+  Congruence scoped;
+  scoped.set_congruent(ab,k);
+  scoped.push_scope();
+  scoped.set_congruent(ba,n);
+  scoped.pop_scope();
+  assert(( scoped.reps.get(ba).is_nothing() ));
+  assert(( scoped.reps.get(ab).is_just ));
+  assert(( scoped.reps.get(n).is_nothing() ));
+  assert(( scoped.is_congruent(ba,k) ));  // through its canonical form
+
+  // and from the use lists of the roots their forms mention, so that
+  // repeated scopes do not grow them
+  for (int i = 0; i < 100; ++i) {
+    scoped.push_scope();
+    scoped.set_congruent(app("plus",a,b),n);
+    scoped.pop_scope(); }
+  for (const auto& u : scoped.forms->uses)
+    assert(( u.second.size() == 1 ));
+
+  // Canonical forms survive the renumbering and keep propagating
+  scoped.set_congruent(cb,m);
+  scoped.compact();
+  assert(( scoped.is_congruent(ba,k) ));
+  assert(( !scoped.is_congruent(k,m) ));
+  scoped.set_congruent(a,c);
+  assert(( scoped.is_congruent(k,m) ));
+}
+
+
+
+// A presized closure does not grow while it is within its reservation
+template <typename Congruence>
+void reserve_test ()
+{
+  std::vector<expr*> mem_pool;
+  expr_parser_t parser(mem_pool);
+  parser.reserve(1000);
+  Congruence eq;
+  eq.reserve(1000,1000);
+  eq.enable_query_cache();
+
+  // Expressions with distinct names, spelled out in letters
+  std::vector<expr*> vs;
+  for (auto n = 0; n < 1000; ++n) {
+    std::string name = "v";
+    for (auto m = n; m; m /= 26)
+      name.push_back('a' + m % 26);
+    vs.push_back(parser.parse(name + "()")); }
+  assert(( mem_pool.capacity() == 1000 ));
+
+  // The first assertion and query fix the node sizes of the pools
+  eq.set_congruent(vs[0],vs[1]);
+  eq.is_congruent(vs[0],vs[1]);
+  auto before = eq.memory_usage();
+  for (auto n = 2; n < 1000; ++n) {
+    eq.set_congruent(vs[n - 1],vs[n]);
+    eq.is_congruent(vs[0],vs[n]); }
+  auto after = eq.memory_usage();
+
+  assert(( eq.sets.parent.size() == 1000 ));
+  assert(( eq.reps.representatives.size() == 1000 ));
+  assert(( eq.cache.size() == 999 ));
+  assert(( after.sets == before.sets ));
+  assert(( after.reps == before.reps ));
+  assert(( after.cache == before.cache ));
+
+  // Compaction returns the storage of released terms
+  for (auto n = 0; n < 900; ++n)
+    eq.release(vs[n]);
+  eq.compact();
+  auto compacted = eq.memory_usage();
+  assert(( eq.is_congruent(vs[900],vs[999]) ));
+  assert(( compacted.sets < after.sets / 5 ));
+  assert(( compacted.reps < after.reps / 5 ));
+
+  // So does clearing, when asked to
+  eq.clear(false);
+  auto cleared = eq.memory_usage();
+  assert(( cleared.sets == 0 ));
+  assert(( cleared.reps == 0 ));
+  assert(( cleared.cache == 0 ));
+}
+
+
+
 int main ()
 {
   simple_test();
+  persistent_test();
+  distinct_test<congruence_t>();
+  distinct_test<persistent_congruence_t>();
+  compact_test<congruence_t>();
+  compact_test<persistent_congruence_t>();
+  batch_test();
+  cache_test<congruence_t>();
+  cache_test<persistent_congruence_t>();
+  parallel_test();
+  ac_test<ac_congruence_t>();
+  ac_test<persistent_ac_congruence_t>();
+  reserve_test<congruence_t>();
   return 0;
 }
\ No newline at end of file